@@ -2,8 +2,11 @@
 #include "board.h"
 #include "display.h"
 #include "system_info.h"
+#include "settings.h"
+#include "dns_cache.h"
 #include "ml307_ssl_transport.h"
 #include "audio_codec.h"
+#include "sample_convert.h"
 #include "mqtt_protocol.h"
 #include "websocket_protocol.h"
 #include "font_awesome_symbols.h"
@@ -11,6 +14,7 @@
 #include "assets/lang_config.h"
 
 #include <cstring>
+#include <algorithm>
 #include <esp_log.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
@@ -34,9 +38,19 @@ static const char* const STATE_STRINGS[] = {
     "invalid_state"
 };
 
-Application::Application() {
+static bool IsOpusNativeSampleRate(int sample_rate) {
+    return sample_rate == 8000 || sample_rate == 12000 || sample_rate == 16000 || sample_rate == 24000 || sample_rate == 48000;
+}
+
+Application::Application()
+    : audio_decode_queue_(AUDIO_DECODE_QUEUE_CAPACITY, AUDIO_DECODE_PACKET_MAX_SIZE, kOverflowDropOldest),
+      jitter_buffer_(JITTER_BUFFER_CAPACITY, AUDIO_DECODE_PACKET_MAX_SIZE),
+      audio_send_queue_(AUDIO_SEND_QUEUE_CAPACITY, OPUS_STREAM_MAX_PACKET_SIZE, UPLINK_OVERFLOW_POLICY),
+      connect_buffer_(UPLINK_CONNECT_BUFFER_PACKETS, UPLINK_CONNECT_PACKET_MAX_SIZE, kOverflowDropOldest) {
     event_group_ = xEventGroupCreate();
-    background_task_ = new BackgroundTask(4096 * 8);
+    // Audio encoding and decoding run in their own tasks, this one only handles light jobs
+    background_task_ = new BackgroundTask(4096 * 2);
+    audio_encode_queue_ = xQueueCreate(AUDIO_ENCODE_QUEUE_DEPTH, sizeof(PcmFrame*));
 
     esp_timer_create_args_t clock_timer_args = {
         .callback = [](void* arg) {
@@ -59,6 +73,7 @@ Application::~Application() {
     if (background_task_ != nullptr) {
         delete background_task_;
     }
+    vQueueDelete(audio_encode_queue_);
     vEventGroupDelete(event_group_);
 }
 
@@ -104,10 +119,7 @@ void Application::CheckNewVersion() {
                 auto codec = board.GetAudioCodec();
                 codec->EnableInput(false);
                 codec->EnableOutput(false);
-                {
-                    std::lock_guard<std::mutex> lock(mutex_);
-                    audio_decode_queue_.clear();
-                }
+                audio_decode_queue_.Clear();
                 background_task_->WaitForCompletion();
                 delete background_task_;
                 background_task_ = nullptr;
@@ -183,7 +195,7 @@ void Application::ShowActivationCode() {
     Alert(Lang::Strings::ACTIVATION, message.c_str(), "happy", Lang::Sounds::P3_ACTIVATION);
     ESP_LOGI(TAG,"message %s.",message.c_str());
     vTaskDelay(pdMS_TO_TICKS(1000));
-    background_task_->WaitForCompletion();
+    WaitForPlayback();
 
     for (const auto& digit : code) {
         auto it = std::find_if(digit_sounds.begin(), digit_sounds.end(),
@@ -225,13 +237,16 @@ void Application::PlaySound(const std::string_view& sound) {
         p += sizeof(BinaryProtocol3);
 
         auto payload_size = ntohs(p3->payload_size);
-        std::vector<uint8_t> opus;
-        opus.resize(payload_size);
-        memcpy(opus.data(), p3->payload, payload_size);
         p += payload_size;
 
-        std::lock_guard<std::mutex> lock(mutex_);
-        audio_decode_queue_.emplace_back(std::move(opus));
+        // Local assets can wait for the decoder instead of overwriting queued packets.
+        // Wait outside the lock so the network receive task is never held up by it.
+        audio_decode_queue_.WaitForRoom(pdMS_TO_TICKS(1000));
+        std::lock_guard<std::mutex> lock(audio_decode_producer_mutex_);
+        audio_decode_queue_.Push(0, p3->payload, payload_size);
+    }
+    if (audio_decode_task_handle_ != nullptr) {
+        xTaskNotifyGive(audio_decode_task_handle_);
     }
 }
 
@@ -248,12 +263,15 @@ void Application::ToggleChatState() {
 
     if (device_state_ == kDeviceStateIdle) {
         Schedule([this]() {
-            SetDeviceState(kDeviceStateConnecting);
-            if (!protocol_->OpenAudioChannel()) {
-                return;
+            ConnectAndListen(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
+        });
+    } else if (device_state_ == kDeviceStateConnecting) {
+        // A second press while connecting gives up on the connection
+        Schedule([this]() {
+            if (device_state_ == kDeviceStateConnecting) {
+                protocol_->CancelOpenAudioChannel();
+                SetDeviceState(kDeviceStateIdle);
             }
-
-            SetListeningMode(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
         });
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
@@ -280,10 +298,8 @@ void Application::StartListening() {
     if (device_state_ == kDeviceStateIdle) {
         Schedule([this]() {
             if (!protocol_->IsAudioChannelOpened()) {
-                SetDeviceState(kDeviceStateConnecting);
-                if (!protocol_->OpenAudioChannel()) {
-                    return;
-                }
+                ConnectAndListen(kListeningModeManualStop);
+                return;
             }
 
             SetListeningMode(kListeningModeManualStop);
@@ -298,8 +314,13 @@ void Application::StartListening() {
 
 void Application::StopListening() {
     Schedule([this]() {
+        if (device_state_ == kDeviceStateConnecting) {
+            // Released before the channel was up, the buffered audio still goes out first
+            stop_listening_after_open_ = true;
+            return;
+        }
         if (device_state_ == kDeviceStateListening) {
-            protocol_->SendStopListening();
+            QueueStopListening();
             SetDeviceState(kDeviceStateIdle);
         }
     });
@@ -314,8 +335,16 @@ void Application::Start() {
 
     /* Setup the audio codec */
     auto codec = board.GetAudioCodec();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
-    opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
+    SetDecodeSampleRate(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
+    opus_encoder_ = std::make_unique<OpusStreamEncoder>(16000, 1, OPUS_FRAME_DURATION_MS);
+    // Cellular links need a deeper playout buffer, both bounds can be tuned per device in NVS
+    {
+        bool cellular = board.GetBoardType() == "ml307";
+        Settings settings("audio", false);
+        jitter_min_delay_ms_ = settings.GetInt("jitter_min_ms", cellular ? 120 : 60);
+        jitter_max_delay_ms_ = settings.GetInt("jitter_max_ms", cellular ? 960 : 480);
+    }
+
     if (realtime_chat_enabled_) {
         ESP_LOGI(TAG, "Realtime chat enabled, setting opus encoder complexity to 0");
         opus_encoder_->SetComplexity(0);
@@ -326,19 +355,63 @@ void Application::Start() {
         ESP_LOGI(TAG, "WiFi board detected, setting opus encoder complexity to 3");
         opus_encoder_->SetComplexity(3);
     }
+    // The board default is only the starting point, the governor follows the actual CPU headroom
+    opus_encoder_->EnableGovernor(0, 8, CONFIG_OPUS_ENCODE_BUDGET_PERCENT);
 
     if (codec->input_sample_rate() != 16000) {
-        input_resampler_.Configure(codec->input_sample_rate(), 16000);
-        reference_resampler_.Configure(codec->input_sample_rate(), 16000);
+        // Integer-ratio inputs take the fused interleaved path, anything else goes through opus
+        if (!capture_resampler_.Configure(codec->input_sample_rate(), 16000, codec->input_channels())) {
+            input_resampler_.Configure(codec->input_sample_rate(), 16000);
+            reference_resampler_.Configure(codec->input_sample_rate(), 16000);
+        }
     }
     codec->Start();
 
+    // Leave room for one more frame of the largest duration on top of the decode-ahead window
+    audio_output_ring_.Allocate(codec->output_sample_rate() * (AUDIO_DECODE_AHEAD_MS + 2 * OPUS_FRAME_DURATION_MS) / 1000);
+
+    // The capture blocks are sized for the chunk fed to the AFE, or 30ms without it.
+    // The pool must be ready before audio_loop takes its first frame.
+    size_t block_samples = 30 * 16000 / 1000;
+#if CONFIG_USE_WAKE_WORD_DETECT || CONFIG_USE_AUDIO_PROCESSOR
+    // One AFE serves both the wake word detector and the uplink processor
+    audio_front_end_.Initialize(codec, realtime_chat_enabled_);
+    block_samples = std::max(block_samples, audio_front_end_.GetFeedSize());
+#endif
+    PcmFramePool::GetInstance().Initialize(PCM_FRAME_POOL_BLOCKS, block_samples);
+
     xTaskCreatePinnedToCore([](void* arg) {
         Application* app = (Application*)arg;
         app->AudioLoop();
         vTaskDelete(NULL);
     }, "audio_loop", 4096 * 2, this, 8, &audio_loop_task_handle_, realtime_chat_enabled_ ? 1 : 0);
 
+    xTaskCreatePinnedToCore([](void* arg) {
+        Application* app = (Application*)arg;
+        app->AudioOutputTask();
+        vTaskDelete(NULL);
+    }, "audio_output", 4096 * 2, this, 8, &audio_output_task_handle_, realtime_chat_enabled_ ? 1 : 0);
+
+    xTaskCreatePinnedToCore([](void* arg) {
+        Application* app = (Application*)arg;
+        app->AudioDecodeTask();
+        vTaskDelete(NULL);
+    }, "audio_decode", 4096 * 6, this, 5, &audio_decode_task_handle_, 0);
+
+    xTaskCreatePinnedToCore([](void* arg) {
+        Application* app = (Application*)arg;
+        app->AudioEncodeTask();
+        vTaskDelete(NULL);
+    }, "audio_encode", 4096 * 8, this, 2, &audio_encode_task_handle_, 0);
+
+    xTaskCreatePinnedToCore([](void* arg) {
+        Application* app = (Application*)arg;
+        app->AudioSendTask();
+        vTaskDelete(NULL);
+    }, "audio_send", 4096 * 3, this, 4, &audio_send_task_handle_, 0);
+    SystemInfo::TrackHeapAllocations(audio_loop_task_handle_);
+    SystemInfo::TrackHeapAllocations(audio_encode_task_handle_);
+
     /* Start the main loop */
     xTaskCreatePinnedToCore([](void* arg) {
         Application* app = (Application*)arg;
@@ -346,9 +419,35 @@ void Application::Start() {
         vTaskDelete(NULL);
     }, "main_loop", 4096 * 2, this, 4, &main_loop_task_handle_, 0);
 
+    xTaskCreate([](void* arg) {
+        Application* app = (Application*)arg;
+        app->SignalQualityTask();
+        vTaskDelete(NULL);
+    }, "signal_quality", 4096, this, 1, &signal_quality_task_handle_);
+
     /* Wait for the network to be ready */
     board.StartNetwork();
 
+    // Resolve the OTA and primary servers up front, the first open then skips the lookup.
+    // The fallbacks follow once the protocol has its endpoint list. The ML307 modem resolves names itself.
+    if (board.GetBoardType() == "wifi") {
+        std::vector<std::string> hosts;
+        std::string host;
+        int port;
+        if (DnsCache::ParseUrl(CONFIG_OTA_VERSION_URL, host, port)) {
+            hosts.push_back(host);
+        }
+#ifdef CONFIG_CONNECTION_TYPE_WEBSOCKET
+        if (DnsCache::ParseUrl(CONFIG_WEBSOCKET_URL, host, port)) {
+            hosts.push_back(host);
+        }
+#else
+        Settings settings("mqtt", false);
+        hosts.push_back(settings.GetString("endpoint"));
+#endif
+        DnsCache::GetInstance().Prefetch(hosts);
+    }
+
     // Initialize the protocol
     // display->SetStatus(Lang::Strings::LOADING_PROTOCOL);
 #ifdef CONFIG_CONNECTION_TYPE_WEBSOCKET
@@ -356,21 +455,34 @@ void Application::Start() {
 #else
     protocol_ = std::make_unique<MqttProtocol>();
 #endif
+    // Start from the link type, the controller adapts once audio flows
+    uplink_controller_.Reset(board.GetBoardType() == "ml307");
+    auto uplink_profile = uplink_controller_.profile();
+    opus_encoder_->SetBitrate(uplink_profile.bitrate);
+    opus_encoder_->SetDuration(uplink_profile.frame_duration_ms);
+    protocol_->SetUplinkFrameDuration(uplink_profile.frame_duration_ms);
+    // Channel opening reports errors from its own task, handle them on the main loop
     protocol_->OnNetworkError([this](const std::string& message) {
-        SetDeviceState(kDeviceStateIdle);
-        Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION);
+        Schedule([this, message]() {
+            SetDeviceState(kDeviceStateIdle);
+            Alert(Lang::Strings::ERROR, message.c_str(), "sad", Lang::Sounds::P3_EXCLAMATION);
+        });
     });
-    protocol_->OnIncomingAudio([this](std::vector<uint8_t>&& data) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        audio_decode_queue_.emplace_back(std::move(data));
+    protocol_->OnIncomingAudio([this](std::vector<uint8_t>&& data, uint32_t sequence) {
+        {
+            std::lock_guard<std::mutex> lock(audio_decode_producer_mutex_);
+            audio_decode_queue_.Push(sequence, data.data(), data.size());
+        }
+        xTaskNotifyGive(audio_decode_task_handle_);
     });
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
         board.SetPowerSaveMode(false);
-        if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
+        if (protocol_->server_sample_rate() != codec->output_sample_rate() && !IsOpusNativeSampleRate(codec->output_sample_rate())) {
             ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
         }
         SetDecodeSampleRate(protocol_->server_sample_rate(), protocol_->server_frame_duration());
+        jitter_buffer_.Configure(protocol_->server_frame_duration(), jitter_min_delay_ms_, jitter_max_delay_ms_);
         auto& thing_manager = iot::ThingManager::GetInstance();
         protocol_->SendIotDescriptors(thing_manager.GetDescriptorsJson());
         std::string states;
@@ -378,8 +490,7 @@ void Application::Start() {
             protocol_->SendIotStates(states);
         }
     });
-    protocol_->OnAudioChannelClosed([this, &board]() {
-        board.SetPowerSaveMode(true);
+    protocol_->OnAudioChannelClosed([this]() {
         Schedule([this]() {
             // auto display = Board::GetInstance().GetDisplay();
             // display->SetChatMessage("system", "");
@@ -400,7 +511,7 @@ void Application::Start() {
                 });
             } else if (strcmp(state->valuestring, "stop") == 0) {
                 Schedule([this]() {
-                    background_task_->WaitForCompletion();
+                    WaitForPlayback();
                     if (device_state_ == kDeviceStateSpeaking) {
                         if (listening_mode_ == kListeningModeManualStop) {
                             SetDeviceState(kDeviceStateIdle);
@@ -445,6 +556,13 @@ void Application::Start() {
         }
     });
     protocol_->Start();
+    // Probing uses lwIP sockets, the ML307 modem has its own stack and keeps the list order
+    if (board.GetBoardType() == "wifi") {
+        // The endpoint lists from the OTA response and the fallbacks are only known now,
+        // failover and the probe then find every server resolved
+        DnsCache::GetInstance().Prefetch(protocol_->endpoint_hosts());
+        protocol_->ProbeEndpoints();
+    }
 #if 0
     // Check for new firmware version or get the MQTT broker address
     xTaskCreate([](void* arg) {
@@ -454,15 +572,38 @@ void Application::Start() {
     }, "check_new_version", 4096 * 2, this, 2, nullptr);
 #endif
 #if CONFIG_USE_AUDIO_PROCESSOR
-    audio_processor_.Initialize(codec, realtime_chat_enabled_);
-    audio_processor_.OnOutput([this](std::vector<int16_t>&& data) {
-        background_task_->Schedule([this, data = std::move(data)]() mutable {
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
-                Schedule([this, opus = std::move(opus)]() {
-                    protocol_->SendAudio(opus);
+    audio_processor_.Initialize(&audio_front_end_);
+    // Realtime mode runs the AFE without VAD, gate silence out of the uplink here instead
+    vad_gate_.Configure(16000, 300, 1000);
+#if CONFIG_ENDPOINT_SILENCE_MS > 0
+    endpoint_detector_.Configure(16000, CONFIG_ENDPOINT_SILENCE_MS, CONFIG_ENDPOINT_SILENCE_MS * 5 / 2);
+#endif
+    audio_processor_.OnOutput([this](PcmFrameRef&& frame) {
+#if CONFIG_ENDPOINT_SILENCE_MS > 0
+        // Close the turn on the device instead of waiting for the server to notice the silence
+        if (listening_mode_ == kListeningModeAutoStop) {
+            if (endpoint_reached_) {
+                return;
+            }
+            if (endpoint_detector_.Process(frame, audio_processor_.is_speaking())) {
+                endpoint_reached_ = true;
+                Schedule([this]() {
+                    if (device_state_ == kDeviceStateListening && endpoint_reached_) {
+                        QueueStopListening();
+                        SetDeviceState(kDeviceStateIdle);
+                    }
                 });
+                return;
+            }
+        }
+#endif
+        if (listening_mode_ == kListeningModeRealtime) {
+            vad_gate_.Process(std::move(frame), [this](PcmFrameRef&& frame) {
+                QueueEncode(std::move(frame));
             });
-        });
+            return;
+        }
+        QueueEncode(std::move(frame));
     });
     audio_processor_.OnVadStateChange([this](bool speaking) {
         if (device_state_ == kDeviceStateListening) {
@@ -480,27 +621,27 @@ void Application::Start() {
 #endif
 
 #if CONFIG_USE_WAKE_WORD_DETECT
-    wake_word_detect_.Initialize(codec);
+    wake_word_detect_.Initialize(&audio_front_end_);
+    // Start connecting while the wake phrase is still being spoken
+    wake_word_detect_.OnVoiceOnset([this]() {
+        if (device_state_ == kDeviceStateIdle && protocol_) {
+            protocol_->Preconnect();
+        }
+    });
     wake_word_detect_.OnWakeWordDetected([this](const std::string& wake_word) {
-        Schedule([this, &wake_word]() {
+        Schedule([this, wake_word]() {
             if (device_state_ == kDeviceStateIdle) {
-                SetDeviceState(kDeviceStateConnecting);
                 wake_word_detect_.EncodeWakeWordData();
-
-                if (!protocol_->OpenAudioChannel()) {
-                    wake_word_detect_.StartDetection();
-                    return;
-                }
-                
-                std::vector<uint8_t> opus;
-                // Encode and send the wake word data to the server
-                while (wake_word_detect_.GetWakeWordOpus(opus)) {
-                    protocol_->SendAudio(opus);
-                }
-                // Set the chat state to wake word detected
-                protocol_->SendWakeWordDetected(wake_word);
-                ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
-                SetListeningMode(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop);
+                ConnectAndListen(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop, [this, wake_word]() {
+                    std::vector<uint8_t> opus;
+                    // Encode and send the wake word data to the server
+                    while (wake_word_detect_.GetWakeWordOpus(opus)) {
+                        protocol_->SendAudio(opus);
+                    }
+                    // Set the chat state to wake word detected
+                    protocol_->SendWakeWordDetected(wake_word);
+                    ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
+                });
             } else if (device_state_ == kDeviceStateSpeaking) {
                 AbortSpeaking(kAbortReasonWakeWordDetected);
             } else if (device_state_ == kDeviceStateActivating) {
@@ -511,6 +652,10 @@ void Application::Start() {
     wake_word_detect_.StartDetection();
 #endif
 
+#if CONFIG_USE_WAKE_WORD_DETECT || CONFIG_USE_AUDIO_PROCESSOR
+    audio_front_end_.Start();
+#endif
+
     SetDeviceState(kDeviceStateIdle);
     esp_timer_start_periodic(clock_timer_handle_, 1000000);
 
@@ -525,12 +670,108 @@ void Application::Start() {
 void Application::OnClockTimer() {
     clock_ticks_++;
 
+    if (clock_ticks_ % 2 == 0 && device_state_ == kDeviceStateListening) {
+        Schedule([this]() {
+            UpdateUplinkProfile();
+        });
+    }
+
+    if (protocol_ && protocol_->IsWarm()) {
+        Schedule([this]() {
+            protocol_->MaintainWarmChannel();
+        });
+    }
+
+    // Keep the server addresses fresh while nothing else uses the network
+    if (clock_ticks_ % 10 == 5 && device_state_ == kDeviceStateIdle) {
+        DnsCache::GetInstance().RefreshExpiring();
+    }
+    if (clock_ticks_ % ENDPOINT_PROBE_INTERVAL_SECONDS == 0 && device_state_ == kDeviceStateIdle && protocol_ &&
+        Board::GetInstance().GetBoardType() == "wifi") {
+        protocol_->ProbeEndpoints();
+    }
+
     // Print the debug info every 10 seconds
     if (clock_ticks_ % 10 == 0) {
         int free_sram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
         int min_free_sram = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
         ESP_LOGI(TAG, "Free internal: %u minimal internal: %u", free_sram, min_free_sram);
 
+        auto stats = audio_decode_queue_.GetStats();
+        if (stats.dropped != last_reported_decode_drops_) {
+            last_reported_decode_drops_ = stats.dropped;
+            ESP_LOGW(TAG, "Decode queue: pushed %lu popped %lu dropped %lu oversized %lu, occupancy %u/%u, high watermark %u",
+                stats.pushed, stats.popped, stats.dropped, stats.oversized, stats.occupancy, stats.capacity, stats.high_watermark);
+        }
+
+        auto pool = PcmFramePool::GetInstance().GetStats();
+        int32_t capture_allocations = SystemInfo::GetHeapAllocations(audio_loop_task_handle_);
+        int32_t encode_allocations = SystemInfo::GetHeapAllocations(audio_encode_task_handle_);
+        ESP_LOGI(TAG, "Frame pool: in use %d/%d high watermark %d fallbacks %lu, heap allocs in 10s: audio_loop %ld audio_encode %ld",
+            pool.in_use, pool.blocks, pool.high_watermark, pool.heap_fallbacks,
+            capture_allocations - last_capture_allocations_, encode_allocations - last_encode_allocations_);
+        last_capture_allocations_ = capture_allocations;
+        last_encode_allocations_ = encode_allocations;
+
+        auto send = audio_send_queue_.GetStats();
+        uint32_t uplink_drops = send.dropped + uplink_stats_.encode_dropped.load();
+        if (uplink_stats_.send.count != uplink_stats_.send.logged_count || uplink_drops != last_reported_send_drops_) {
+            last_reported_send_drops_ = uplink_drops;
+            auto log_stage = [](const char* name, StageLatency& stage) {
+                uint32_t count = stage.count.load();
+                uint32_t total = stage.total_us.load();
+                uint32_t max = stage.max_us.exchange(0);
+                uint32_t window_count = count - stage.logged_count;
+                uint32_t window_total = total - stage.logged_total_us;
+                stage.logged_count = count;
+                stage.logged_total_us = total;
+                ESP_LOGI(TAG, "Uplink %s: avg %lu us max %lu us", name, window_count > 0 ? window_total / window_count : 0, max);
+            };
+            log_stage("encode wait", uplink_stats_.encode_wait);
+            log_stage("encode", uplink_stats_.encode);
+            log_stage("send wait", uplink_stats_.send_wait);
+            log_stage("send", uplink_stats_.send);
+            ESP_LOGI(TAG, "Uplink drops: encode %lu send %lu, send queue high watermark %u/%u",
+                uplink_stats_.encode_dropped.load(), send.dropped, send.high_watermark, send.capacity);
+        }
+
+        if (protocol_) {
+            auto writes = protocol_->GetAudioWriteStats();
+            if (writes.writes != last_reported_audio_writes_.writes) {
+                uint32_t window_writes = writes.writes - last_reported_audio_writes_.writes;
+                uint32_t window_packets = writes.packets - last_reported_audio_writes_.packets;
+                uint32_t window_bytes = writes.wire_bytes - last_reported_audio_writes_.wire_bytes;
+                last_reported_audio_writes_ = writes;
+                ESP_LOGI(TAG, "Uplink writes: %lu for %lu packets, %lu bytes on wire (%lu per packet)",
+                    window_writes, window_packets, window_bytes, window_packets > 0 ? window_bytes / window_packets : 0);
+            }
+        }
+
+        // How long scheduled work waits for the main loop, blocking calls on the loop show up here
+        uint32_t loop_count = main_loop_delay_.count.load();
+        if (loop_count != main_loop_delay_.logged_count) {
+            uint32_t loop_total = main_loop_delay_.total_us.load();
+            ESP_LOGI(TAG, "Main loop queuing: avg %lu us max %lu us over %lu tasks",
+                (loop_total - main_loop_delay_.logged_total_us) / (loop_count - main_loop_delay_.logged_count),
+                main_loop_delay_.max_us.exchange(0), loop_count - main_loop_delay_.logged_count);
+            main_loop_delay_.logged_count = loop_count;
+            main_loop_delay_.logged_total_us = loop_total;
+        }
+
+        auto gate = vad_gate_.GetStats();
+        if (gate.frames != last_reported_gate_frames_) {
+            last_reported_gate_frames_ = gate.frames;
+            ESP_LOGI(TAG, "VAD gate: suppressed %lu/%lu frames (%d%%)", gate.suppressed, gate.frames, gate.suppressed_percent);
+        }
+
+        auto jitter = jitter_buffer_.GetStats();
+        if (jitter.received != last_reported_jitter_received_) {
+            last_reported_jitter_received_ = jitter.received;
+            ESP_LOGI(TAG, "Jitter buffer: depth %d target %d ms jitter %d ms, received %lu played %lu late %lu dup %lu lost %lu concealed %lu underruns %lu",
+                jitter.depth, jitter.target_delay_ms, jitter.jitter_ms, jitter.received, jitter.played, jitter.late,
+                jitter.duplicate, jitter.lost, jitter.concealed, jitter.underruns);
+        }
+
         // If we have synchronized server time, set the status to clock "HH:MM" if the device is idle
         if (ota_.HasServerTime()) {
             if (device_state_ == kDeviceStateIdle) {
@@ -546,11 +787,57 @@ void Application::OnClockTimer() {
     }
 }
 
+// Feed the last window of link measurements to the controller and apply its profile.
+// Bitrate changes take effect at once, frame duration at the next utterance and in the next hello.
+void Application::UpdateUplinkProfile() {
+    if ((clock_ticks_ % 10 == 0 || signal_quality_ < 0) && signal_quality_task_handle_ != nullptr) {
+        // Refreshed in the background, this window uses the last reading
+        xTaskNotifyGive(signal_quality_task_handle_);
+    }
+
+    auto send = audio_send_queue_.GetStats();
+    auto jitter = jitter_buffer_.GetStats();
+    uint32_t send_count = uplink_stats_.send.count.load();
+    uint32_t send_total_us = uplink_stats_.send.total_us.load();
+    uint32_t send_drops = send.dropped + uplink_stats_.encode_dropped.load();
+    uint32_t received = jitter.received - link_received_;
+    uint32_t lost = jitter.lost - link_lost_;
+
+    LinkSample sample = {
+        .send_queue_depth = send.occupancy,
+        .send_queue_capacity = send.capacity,
+        .send_drops = send_drops - link_send_drops_,
+        .packets_expected = received + lost,
+        .packets_lost = lost,
+        .send_latency_us = send_count != link_send_count_ ? (send_total_us - link_send_total_us_) / (send_count - link_send_count_) : 0,
+        .signal_quality = signal_quality_,
+    };
+    link_send_count_ = send_count;
+    link_send_total_us_ = send_total_us;
+    link_send_drops_ = send_drops;
+    link_received_ = jitter.received;
+    link_lost_ = jitter.lost;
+
+    if (uplink_controller_.Update(sample)) {
+        auto profile = uplink_controller_.profile();
+        opus_encoder_->SetBitrate(profile.bitrate);
+        protocol_->SetUplinkFrameDuration(profile.frame_duration_ms);
+    }
+}
+
+void Application::SignalQualityTask() {
+    auto& board = Board::GetInstance();
+    while (true) {
+        signal_quality_ = board.GetSignalQuality();
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
 // Add a async task to MainLoop
 void Application::Schedule(std::function<void()> callback) {
     {
         std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
+        main_tasks_.push_back({esp_timer_get_time(), std::move(callback)});
     }
     xEventGroupSetBits(event_group_, SCHEDULE_EVENT);
 }
@@ -564,144 +851,358 @@ void Application::MainLoop() {
 
         if (bits & SCHEDULE_EVENT) {
             std::unique_lock<std::mutex> lock(mutex_);
-            std::list<std::function<void()>> tasks = std::move(main_tasks_);
+            std::list<ScheduledTask> tasks = std::move(main_tasks_);
             lock.unlock();
             for (auto& task : tasks) {
-                task();
+                main_loop_delay_.Add(esp_timer_get_time() - task.scheduled_time);
+                task.callback();
             }
         }
     }
 }
 
-// The Audio Loop is used to input and output audio data
+// The Audio Loop is used to input audio data, playback runs in the decode and output tasks
 void Application::AudioLoop() {
-    auto codec = Board::GetInstance().GetAudioCodec();
     while (true) {
         OnAudioInput();
-        if (codec->output_enabled()) {
-            OnAudioOutput();
+    }
+}
+
+// Pull the next frame to decode, an empty packet asks the decoder for packet loss concealment
+bool Application::PullDecodeFrame(std::vector<uint8_t>& opus) {
+    uint32_t sequence;
+    while (jitter_buffer_.HasRoom() && audio_decode_queue_.Pop(opus, sequence)) {
+        if (sequence == 0) {
+            // Local assets are played in order without buffering
+            return true;
         }
+        jitter_buffer_.Put(sequence, opus);
     }
+    return jitter_buffer_.Get(opus) != kJitterBufferNone;
 }
 
-void Application::OnAudioOutput() {
-    auto now = std::chrono::steady_clock::now();
+// The decode task keeps up to AUDIO_DECODE_AHEAD_MS of pcm ready for the output task
+void Application::AudioDecodeTask() {
     auto codec = Board::GetInstance().GetAudioCodec();
-    const int max_silence_seconds = 10;
+    const size_t ahead_samples = codec->output_sample_rate() * AUDIO_DECODE_AHEAD_MS / 1000;
+    std::vector<uint8_t> opus;
+    std::vector<int16_t> pcm;
+    std::vector<int16_t> resampled;
 
-    std::unique_lock<std::mutex> lock(mutex_);
-    if (audio_decode_queue_.empty()) {
-        // Disable the output if there is no audio data for a long time
-        if (device_state_ == kDeviceStateIdle) {
-            auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - last_output_time_).count();
-            if (duration > max_silence_seconds) {
-                codec->EnableOutput(false);
-            }
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20));
+        if (!codec->output_enabled()) {
+            continue;
         }
-        return;
-    }
 
-    if (device_state_ == kDeviceStateListening) {
-        audio_decode_queue_.clear();
-        return;
-    }
+        if (device_state_ == kDeviceStateListening) {
+            audio_decode_queue_.Clear();
+            jitter_buffer_.Reset();
+            continue;
+        }
 
-    auto opus = std::move(audio_decode_queue_.front());
-    audio_decode_queue_.pop_front();
-    lock.unlock();
+        while (audio_output_ring_.available() < ahead_samples && PullDecodeFrame(opus)) {
+            if (aborted_) {
+                continue;
+            }
 
-    background_task_->Schedule([this, codec, opus = std::move(opus)]() mutable {
-        if (aborted_) {
-            return;
+            std::lock_guard<std::mutex> lock(decoder_mutex_);
+            if (!opus_decoder_->Decode(std::move(opus), pcm)) {
+                continue;
+            }
+            const int16_t* output = pcm.data();
+            size_t samples = pcm.size();
+            // Resample if the sample rate is different
+            if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
+                resampled.resize(output_resampler_.GetOutputSamples(pcm.size()));
+                output_resampler_.Process(pcm.data(), pcm.size(), resampled.data());
+                output = resampled.data();
+                samples = resampled.size();
+            }
+            if (audio_output_ring_.Write(output, samples) < samples) {
+                ESP_LOGW(TAG, "Output ring overflow, dropped %u samples", samples);
+            }
+            xTaskNotifyGive(audio_output_task_handle_);
         }
+    }
+}
 
-        std::vector<int16_t> pcm;
-        if (!opus_decoder_->Decode(std::move(opus), pcm)) {
-            return;
+// The output task drains the pcm ring into the codec, blocking on I2S DMA
+void Application::AudioOutputTask() {
+    auto codec = Board::GetInstance().GetAudioCodec();
+    const size_t chunk_samples = codec->output_sample_rate() * AUDIO_OUTPUT_CHUNK_MS / 1000;
+    const int max_silence_seconds = 10;
+    std::vector<int16_t> chunk(chunk_samples);
+
+    while (true) {
+        if (!codec->output_enabled()) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20));
+            continue;
         }
-        // Resample if the sample rate is different
-        if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-            int target_size = output_resampler_.GetOutputSamples(pcm.size());
-            std::vector<int16_t> resampled(target_size);
-            output_resampler_.Process(pcm.data(), pcm.size(), resampled.data());
-            pcm = std::move(resampled);
+
+        chunk.resize(chunk_samples);
+        size_t samples = audio_output_ring_.Read(chunk.data(), chunk_samples);
+        if (samples == 0) {
+            // Disable the output if there is no audio data for a long time
+            if (device_state_ == kDeviceStateIdle) {
+                auto duration = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - last_output_time_).count();
+                if (duration > max_silence_seconds) {
+                    codec->EnableOutput(false);
+                }
+            }
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20));
+            continue;
         }
-        codec->OutputData(pcm);
+
+        chunk.resize(samples);
+        codec->OutputData(chunk);
         last_output_time_ = std::chrono::steady_clock::now();
-    });
+        xTaskNotifyGive(audio_decode_task_handle_);
+    }
+}
+
+// Block until everything queued for playback has been handed to the codec
+void Application::WaitForPlayback() {
+    auto codec = Board::GetInstance().GetAudioCodec();
+    while (codec->output_enabled() &&
+        (!audio_decode_queue_.empty() || jitter_buffer_.depth() > 0 || audio_output_ring_.available() > 0)) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
 }
 
 void Application::OnAudioInput() {
-    std::vector<int16_t> data;
+    PcmFrameRef frame;
 
+#if CONFIG_USE_WAKE_WORD_DETECT || CONFIG_USE_AUDIO_PROCESSOR
+    bool front_end_running = false;
 #if CONFIG_USE_WAKE_WORD_DETECT
-    if (wake_word_detect_.IsDetectionRunning()) {
-        ReadAudio(data, 16000, wake_word_detect_.GetFeedSize());
-        wake_word_detect_.Feed(data);
-        return;
-    }
+    front_end_running |= wake_word_detect_.IsDetectionRunning();
 #endif
 #if CONFIG_USE_AUDIO_PROCESSOR
-    if (audio_processor_.IsRunning()) {
-        ReadAudio(data, 16000, audio_processor_.GetFeedSize());
-        audio_processor_.Feed(data);
+    front_end_running |= audio_processor_.IsRunning();
+#endif
+    if (front_end_running) {
+        ReadAudio(frame, 16000, audio_front_end_.GetFeedSize());
+        if (frame) {
+            audio_front_end_.Feed(frame);
+        }
         return;
     }
-#else
-    if (device_state_ == kDeviceStateListening) {
-        ReadAudio(data, 16000, 30 * 16000 / 1000);
-        background_task_->Schedule([this, data = std::move(data)]() mutable {
-            opus_encoder_->Encode(std::move(data), [this](std::vector<uint8_t>&& opus) {
-                Schedule([this, opus = std::move(opus)]() {
-                    protocol_->SendAudio(opus);
-                });
-            });
-        });
+#endif
+#if !CONFIG_USE_AUDIO_PROCESSOR
+    if (device_state_ == kDeviceStateListening || uplink_held_) {
+        ReadAudio(frame, 16000, 30 * 16000 / 1000);
+        if (frame) {
+            QueueEncode(std::move(frame));
+        }
         return;
     }
 #endif
     vTaskDelay(pdMS_TO_TICKS(30));
 }
 
-void Application::ReadAudio(std::vector<int16_t>& data, int sample_rate, int samples) {
+void Application::ReadAudio(PcmFrameRef& frame, int sample_rate, int samples) {
     auto codec = Board::GetInstance().GetAudioCodec();
+    frame = PcmFramePool::GetInstance().Acquire(samples);
+    if (!frame) {
+        // Out of memory, drop this chunk
+        vTaskDelay(pdMS_TO_TICKS(30));
+        return;
+    }
     if (codec->input_sample_rate() != sample_rate) {
-        data.resize(samples * codec->input_sample_rate() / sample_rate);
-        if (!codec->InputData(data)) {
+        read_buffer_.resize(samples * codec->input_sample_rate() / sample_rate);
+        if (!codec->InputData(read_buffer_)) {
+            memset(frame.data(), 0, frame.size() * sizeof(int16_t));
             return;
         }
-        if (codec->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
-            }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
-            }
+        if (capture_resampler_.configured()) {
+            // Mic and reference stay interleaved, filtered straight into the frame
+            int channels = capture_resampler_.channels();
+            size_t frames = capture_resampler_.Process(read_buffer_.data(), read_buffer_.size() / channels,
+                frame.data(), frame.size() / channels);
+            memset(frame.data() + frames * channels, 0, (frame.size() - frames * channels) * sizeof(int16_t));
+        } else if (codec->input_channels() == 2) {
+            size_t channel_samples = read_buffer_.size() / 2;
+            mic_channel_.resize(channel_samples);
+            reference_channel_.resize(channel_samples);
+            DeinterleaveStereo(read_buffer_.data(), mic_channel_.data(), reference_channel_.data(), channel_samples);
+            resampled_mic_.resize(input_resampler_.GetOutputSamples(channel_samples));
+            resampled_reference_.resize(reference_resampler_.GetOutputSamples(channel_samples));
+            input_resampler_.Process(mic_channel_.data(), channel_samples, resampled_mic_.data());
+            reference_resampler_.Process(reference_channel_.data(), channel_samples, resampled_reference_.data());
+            size_t frames = std::min(frame.capacity() / 2, std::min(resampled_mic_.size(), resampled_reference_.size()));
+            frame.resize(frames * 2);
+            InterleaveStereo(resampled_mic_.data(), resampled_reference_.data(), frame.data(), frames);
         } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
+            size_t resampled = input_resampler_.GetOutputSamples(read_buffer_.size());
+            if (resampled > frame.capacity()) {
+                frame = PcmFramePool::GetInstance().Acquire(resampled);
+                if (!frame) {
+                    return;
+                }
+            }
+            frame.resize(resampled);
+            input_resampler_.Process(read_buffer_.data(), read_buffer_.size(), frame.data());
         }
     } else {
-        data.resize(samples);
-        if (!codec->InputData(data)) {
+        if (!codec->InputData(frame.data(), samples)) {
+            memset(frame.data(), 0, samples * sizeof(int16_t));
+        }
+    }
+}
+
+// Hand a captured frame to the encode task without blocking the capture path
+void Application::QueueEncode(PcmFrameRef&& frame) {
+    PcmFrame* raw = frame.release();
+    raw->timestamp = esp_timer_get_time();
+    if (xQueueSend(audio_encode_queue_, &raw, 0) == pdTRUE) {
+        return;
+    }
+    uplink_stats_.encode_dropped++;
+#if CONFIG_UPLINK_DROP_NEWEST
+    PcmFrameRef dropped(raw);
+#else
+    PcmFrame* oldest = nullptr;
+    if (xQueueReceive(audio_encode_queue_, &oldest, 0) == pdTRUE) {
+        PcmFrameRef dropped(oldest);
+    }
+    if (xQueueSend(audio_encode_queue_, &raw, 0) != pdTRUE) {
+        PcmFrameRef dropped(raw);
+    }
+#endif
+}
+
+// Stage 1: pcm frames -> opus packets in the send queue
+void Application::AudioEncodeTask() {
+    while (true) {
+        PcmFrame* raw = nullptr;
+        if (xQueueReceive(audio_encode_queue_, &raw, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        PcmFrameRef frame(raw);
+        int64_t start_time = esp_timer_get_time();
+        uplink_stats_.encode_wait.Add(start_time - raw->timestamp);
+        opus_encoder_->Encode(frame.data(), frame.size(), [this](const uint8_t* opus, size_t size) {
+            if (uplink_held_) {
+                connect_buffer_.Push(0, opus, size);
+                return;
+            }
+            audio_send_queue_.Push(0, opus, size);
+            xTaskNotifyGive(audio_send_task_handle_);
+        });
+        uplink_stats_.encode.Add(esp_timer_get_time() - start_time);
+    }
+}
+
+// Stage 2: drain the send queue to the network, a slow send only backs up this task
+void Application::AudioSendTask() {
+    std::vector<uint8_t> opus;
+    opus.reserve(OPUS_STREAM_MAX_PACKET_SIZE);
+    std::vector<uint8_t> held;
+    held.reserve(UPLINK_CONNECT_PACKET_MAX_SIZE);
+    uint32_t sequence;
+    uint32_t enqueue_time;
+    // Audio captured before the channel opened always goes out ahead of live packets
+    auto flush_connect_buffer = [this, &held]() {
+        uint32_t sequence;
+        while (!uplink_held_ && connect_buffer_.Pop(held, sequence)) {
+            protocol_->SendAudio(held);
+        }
+    };
+    while (true) {
+        // A partly filled batch waits at most one frame for the next packet
+        TickType_t timeout = portMAX_DELAY;
+        if (protocol_ && protocol_->HasPendingAudio()) {
+            timeout = pdMS_TO_TICKS(protocol_->uplink_frame_duration());
+        }
+        if (ulTaskNotifyTake(pdTRUE, timeout) == 0) {
+            protocol_->FlushAudio();
+            continue;
+        }
+        flush_connect_buffer();
+        while (audio_send_queue_.Pop(opus, sequence, enqueue_time)) {
+            flush_connect_buffer();
+            int64_t start_time = esp_timer_get_time();
+            uint32_t queue_delay_ms = (uint32_t)(start_time / 1000) - enqueue_time;
+            uplink_stats_.send_wait.Add(queue_delay_ms * 1000);
+            protocol_->SendAudio(opus, queue_delay_ms);
+            uplink_stats_.send.Add(esp_timer_get_time() - start_time);
+        }
+        SendQueuedStopListening();
+    }
+}
+
+void Application::QueueStopListening() {
+    {
+        std::lock_guard<std::mutex> lock(stop_listening_mutex_);
+        stop_listening_queued_ = true;
+    }
+    xTaskNotifyGive(audio_send_task_handle_);
+}
+
+// Runs on the send task once the queue is empty, or on the main loop before the next listen
+// start when the send task is still stuck in a write, so the stop goes out once and ahead of
+// the start. Neither waits for the write lock, the protocol flushes its batch on the lane.
+void Application::SendQueuedStopListening() {
+    std::lock_guard<std::mutex> lock(stop_listening_mutex_);
+    if (stop_listening_queued_) {
+        stop_listening_queued_ = false;
+        protocol_->SendStopListening();
+    }
+}
+
+// Open the channel off the main loop with capture already running, then start listening.
+// on_opened runs on the main loop once the channel is up, before the listen command.
+void Application::ConnectAndListen(ListeningMode mode, std::function<void()> on_opened) {
+    SetDeviceState(kDeviceStateConnecting);
+    StartCaptureBeforeConnect(mode);
+    stop_listening_after_open_ = false;
+    protocol_->OpenAudioChannelAsync([this, mode, on_opened](bool opened) {
+        // Failures are reported through OnNetworkError, which returns to idle
+        if (!opened || device_state_ != kDeviceStateConnecting) {
             return;
         }
+        if (on_opened) {
+            on_opened();
+        }
+        SetListeningMode(mode);
+        if (stop_listening_after_open_) {
+            stop_listening_after_open_ = false;
+            StopListening();
+        }
+    });
+}
+
+// Capture and encode from the moment the user asks to talk, the packets wait in connect_buffer_
+// until the channel is open and listening starts, entering idle drops them
+void Application::StartCaptureBeforeConnect(ListeningMode mode) {
+    listening_mode_ = mode;
+    opus_encoder_->ResetState();
+    // Long frames stretch the buffer, the link profile takes over once listening starts
+    opus_encoder_->SetDuration(OPUS_FRAME_DURATION_MS);
+    audio_send_queue_.Clear();
+    connect_buffer_.Clear();
+    uplink_held_ = true;
+    {
+        // The channel is opened again, a stop for the previous session must not reach the new one
+        std::lock_guard<std::mutex> lock(stop_listening_mutex_);
+        stop_listening_queued_ = false;
     }
+#if CONFIG_USE_WAKE_WORD_DETECT
+    wake_word_detect_.StopDetection();
+#endif
+#if CONFIG_USE_AUDIO_PROCESSOR
+    vad_gate_.Reset();
+    endpoint_detector_.Reset();
+    endpoint_reached_ = false;
+    audio_processor_.Start();
+#endif
 }
 
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+    audio_output_ring_.Flush();
     protocol_->SendAbortSpeaking(reason);
 }
 
@@ -731,9 +1232,16 @@ void Application::SetDeviceState(DeviceState state) {
         case kDeviceStateIdle:
             // display->SetStatus(Lang::Strings::STANDBY);
             // display->SetEmotion("neutral");
+            // Every way a session ends lands here: close, network error, cancelled or failed open
+            board.SetPowerSaveMode(true);
 #if CONFIG_USE_AUDIO_PROCESSOR
             audio_processor_.Stop();
 #endif
+            if (uplink_held_) {
+                ESP_LOGW(TAG, "Audio channel not opened, dropping %u captured packets", connect_buffer_.size());
+                uplink_held_ = false;
+                connect_buffer_.Clear();
+            }
 #if CONFIG_USE_WAKE_WORD_DETECT
             wake_word_detect_.StartDetection();
 #endif
@@ -754,6 +1262,20 @@ void Application::SetDeviceState(DeviceState state) {
             // Update the IoT states before sending the start listening command
             UpdateIotStates();
 
+            if (uplink_held_) {
+                // Capture is already running since before the channel opened, release what it buffered
+                protocol_->SendStartListening(listening_mode_);
+                ESP_LOGI(TAG, "Flushing %u packets captured while connecting", connect_buffer_.size());
+                opus_encoder_->SetDuration(uplink_controller_.profile().frame_duration_ms);
+                uplink_held_ = false;
+                xTaskNotifyGive(audio_send_task_handle_);
+                if (endpoint_reached_) {
+                    // The user already finished talking while the channel was opening
+                    StopListening();
+                }
+                break;
+            }
+
             // Make sure the audio processor is running
 #if CONFIG_USE_AUDIO_PROCESSOR
             if (!audio_processor_.IsRunning()) {
@@ -761,12 +1283,20 @@ void Application::SetDeviceState(DeviceState state) {
             if (true) {
 #endif
                 // Send the start listening command
+                SendQueuedStopListening();
                 protocol_->SendStartListening(listening_mode_);
                 if (listening_mode_ == kListeningModeAutoStop && previous_state == kDeviceStateSpeaking) {
                     // FIXME: Wait for the speaker to empty the buffer
                     vTaskDelay(pdMS_TO_TICKS(120));
                 }
                 opus_encoder_->ResetState();
+                opus_encoder_->SetDuration(uplink_controller_.profile().frame_duration_ms);
+                audio_send_queue_.Clear();
+#if CONFIG_USE_AUDIO_PROCESSOR
+                vad_gate_.Reset();
+                endpoint_detector_.Reset();
+                endpoint_reached_ = false;
+#endif
 #if CONFIG_USE_WAKE_WORD_DETECT
                 wake_word_detect_.StopDetection();
 #endif
@@ -795,9 +1325,11 @@ void Application::SetDeviceState(DeviceState state) {
 }
 
 void Application::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(mutex_);
+    std::lock_guard<std::mutex> lock(decoder_mutex_);
     opus_decoder_->ResetState();
-    audio_decode_queue_.clear();
+    audio_decode_queue_.Clear();
+    jitter_buffer_.Reset();
+    audio_output_ring_.Flush();
     last_output_time_ = std::chrono::steady_clock::now();
     
     auto codec = Board::GetInstance().GetAudioCodec();
@@ -805,17 +1337,41 @@ void Application::ResetDecoder() {
 }
 
 void Application::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
+    std::lock_guard<std::mutex> lock(decoder_mutex_);
+    auto it = std::find_if(opus_decoders_.begin(), opus_decoders_.end(), [=](const DecoderSlot& slot) {
+        return slot.stream_sample_rate == sample_rate && slot.frame_duration == frame_duration;
+    });
+    if (it != opus_decoders_.end() && it->decoder.get() == opus_decoder_) {
         return;
     }
 
-    opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+    if (it != opus_decoders_.end()) {
+        // Reuse the warm decoder, only its state from the previous stream is dropped
+        auto slot = std::move(*it);
+        opus_decoders_.erase(it);
+        slot.decoder->ResetState();
+        opus_decoders_.push_back(std::move(slot));
+    } else {
+        if (opus_decoders_.size() >= OPUS_DECODER_CACHE_SIZE) {
+            opus_decoders_.erase(opus_decoders_.begin());
+        }
+        // Opus decodes any stream at any of its native rates, so skip the resampler when the codec runs at one
+        auto codec = Board::GetInstance().GetAudioCodec();
+        int decode_sample_rate = IsOpusNativeSampleRate(codec->output_sample_rate()) ? codec->output_sample_rate() : sample_rate;
+        ESP_LOGI(TAG, "Create opus decoder for %d Hz %d ms stream at %d Hz", sample_rate, frame_duration, decode_sample_rate);
+        opus_decoders_.push_back(DecoderSlot {
+            .stream_sample_rate = sample_rate,
+            .frame_duration = frame_duration,
+            .decoder = std::make_unique<OpusDecoderWrapper>(decode_sample_rate, 1, frame_duration),
+        });
+    }
+    opus_decoder_ = opus_decoders_.back().decoder.get();
 
     auto codec = Board::GetInstance().GetAudioCodec();
-    if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
+    if (opus_decoder_->sample_rate() != codec->output_sample_rate() && opus_decoder_->sample_rate() != output_resampler_rate_) {
         ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
         output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
+        output_resampler_rate_ = opus_decoder_->sample_rate();
     }
 }
 
@@ -834,12 +1390,13 @@ void Application::Reboot() {
 
 void Application::WakeWordInvoke(const std::string& wake_word) {
     if (device_state_ == kDeviceStateIdle) {
-        ToggleChatState();
         Schedule([this, wake_word]() {
-            if (protocol_) {
-                protocol_->SendWakeWordDetected(wake_word); 
+            if (device_state_ == kDeviceStateIdle && protocol_) {
+                ConnectAndListen(realtime_chat_enabled_ ? kListeningModeRealtime : kListeningModeAutoStop, [this, wake_word]() {
+                    protocol_->SendWakeWordDetected(wake_word);
+                });
             }
-        }); 
+        });
     } else if (device_state_ == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
@@ -862,6 +1419,11 @@ bool Application::CanEnterSleepMode() {
         return false;
     }
 
+    // The warm window is bounded, power saving starts counting once the transport is closed
+    if (protocol_ && protocol_->IsWarm()) {
+        return false;
+    }
+
     // Now it is safe to enter sleep mode
     return true;
 }
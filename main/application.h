@@ -4,11 +4,13 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <freertos/task.h>
+#include <freertos/queue.h>
 #include <esp_timer.h>
 
 #include <string>
 #include <mutex>
 #include <list>
+#include <atomic>
 
 #include <opus_encoder.h>
 #include <opus_decoder.h>
@@ -17,7 +19,19 @@
 #include "protocol.h"
 #include "ota.h"
 #include "background_task.h"
+#include "opus_packet_queue.h"
+#include "jitter_buffer.h"
+#include "pcm_ring_buffer.h"
+#include "pcm_frame_pool.h"
+#include "opus_stream_encoder.h"
+#include "capture_resampler.h"
+#include "uplink_controller.h"
+#include "vad_gate.h"
+#include "endpoint_detector.h"
 
+#if CONFIG_USE_WAKE_WORD_DETECT || CONFIG_USE_AUDIO_PROCESSOR
+#include "audio_front_end.h"
+#endif
 #if CONFIG_USE_WAKE_WORD_DETECT
 #include "wake_word_detect.h"
 #endif
@@ -44,6 +58,66 @@ enum DeviceState {
 
 #define OPUS_FRAME_DURATION_MS 60
 
+// Downlink opus packets buffered ahead of the decoder (60ms each)
+#if CONFIG_SPIRAM
+#define AUDIO_DECODE_QUEUE_CAPACITY 128
+#define AUDIO_DECODE_PACKET_MAX_SIZE 1000
+#else
+#define AUDIO_DECODE_QUEUE_CAPACITY 32
+#define AUDIO_DECODE_PACKET_MAX_SIZE 512
+#endif
+// Frames the jitter buffer can hold for reordering (~2 seconds at 60ms)
+#define JITTER_BUFFER_CAPACITY 32
+// PCM decoded ahead of the speaker, and the size of each write to the codec
+#define AUDIO_DECODE_AHEAD_MS 180
+#define AUDIO_OUTPUT_CHUNK_MS 20
+// Capture frames shared by ReadAudio, the AFE, the VAD gate pre-roll and the encoder
+#define PCM_FRAME_POOL_BLOCKS (12 + VAD_GATE_PREROLL_FRAMES)
+#define AUDIO_ENCODE_QUEUE_DEPTH 8
+// Uplink: about one second of 60ms packets waiting for the network
+#define AUDIO_SEND_QUEUE_CAPACITY 16
+#if CONFIG_UPLINK_DROP_NEWEST
+#define UPLINK_OVERFLOW_POLICY kOverflowDropNewest
+#else
+#define UPLINK_OVERFLOW_POLICY kOverflowDropOldest
+#endif
+// Uplink captured while the audio channel is still opening, encoded with 60ms frames
+#if CONFIG_SPIRAM
+#define UPLINK_CONNECT_BUFFER_PACKETS 100
+#else
+#define UPLINK_CONNECT_BUFFER_PACKETS 32
+#endif
+#define UPLINK_CONNECT_PACKET_MAX_SIZE 512
+// Warm decoders kept per stream format, enough for the local assets plus one server format
+#define OPUS_DECODER_CACHE_SIZE 2
+
+// Latency of one pipeline stage, written by the owning task. count and total_us only grow,
+// readers keep their own snapshot and take deltas; max_us is reset by the clock timer.
+struct StageLatency {
+    std::atomic<uint32_t> count{0};
+    std::atomic<uint32_t> total_us{0};
+    std::atomic<uint32_t> max_us{0};
+    uint32_t logged_count = 0;
+    uint32_t logged_total_us = 0;
+
+    void Add(int64_t us) {
+        uint32_t value = us > 0 ? (uint32_t)us : 0;
+        count++;
+        total_us += value;
+        uint32_t max = max_us.load();
+        while (value > max && !max_us.compare_exchange_weak(max, value)) {
+        }
+    }
+};
+
+struct UplinkStats {
+    StageLatency encode_wait; // frame queued -> encoder picks it up
+    StageLatency encode;
+    StageLatency send_wait;   // packet queued -> sender picks it up
+    StageLatency send;
+    std::atomic<uint32_t> encode_dropped{0};
+};
+
 class Application {
 public:
     static Application& GetInstance() {
@@ -75,6 +149,9 @@ private:
     Application();
     ~Application();
 
+#if CONFIG_USE_WAKE_WORD_DETECT || CONFIG_USE_AUDIO_PROCESSOR
+    AudioFrontEnd audio_front_end_;
+#endif
 #if CONFIG_USE_WAKE_WORD_DETECT
     WakeWordDetect wake_word_detect_;
 #endif
@@ -83,7 +160,13 @@ private:
 #endif
     Ota ota_;
     std::mutex mutex_;
-    std::list<std::function<void()>> main_tasks_;
+    struct ScheduledTask {
+        int64_t scheduled_time;
+        std::function<void()> callback;
+    };
+    std::list<ScheduledTask> main_tasks_;
+    StageLatency main_loop_delay_;
+    bool stop_listening_after_open_ = false;
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
     esp_timer_handle_t clock_timer_handle_ = nullptr;
@@ -94,7 +177,7 @@ private:
 #else
     bool realtime_chat_enabled_ = false;
 #endif
-    bool aborted_ = false;
+    std::atomic<bool> aborted_{false};
     bool voice_detected_ = false;
     int clock_ticks_ = 0;
     TaskHandle_t main_loop_task_handle_ = nullptr;
@@ -104,19 +187,84 @@ private:
     TaskHandle_t audio_loop_task_handle_ = nullptr;
     BackgroundTask* background_task_ = nullptr;
     std::chrono::steady_clock::time_point last_output_time_;
-    std::list<std::vector<uint8_t>> audio_decode_queue_;
+    OpusPacketQueue audio_decode_queue_;
+    std::mutex audio_decode_producer_mutex_;
+    uint32_t last_reported_decode_drops_ = 0;
+    JitterBuffer jitter_buffer_;
+    int jitter_min_delay_ms_ = 60;
+    int jitter_max_delay_ms_ = 600;
+    uint32_t last_reported_jitter_received_ = 0;
+    TaskHandle_t audio_decode_task_handle_ = nullptr;
+    TaskHandle_t audio_output_task_handle_ = nullptr;
+    PcmRingBuffer audio_output_ring_;
+    std::mutex decoder_mutex_;
+    TaskHandle_t audio_encode_task_handle_ = nullptr;
+    QueueHandle_t audio_encode_queue_ = nullptr;
+    OpusPacketQueue audio_send_queue_;
+    // Packets captured before the channel opened, held back until listening starts
+    OpusPacketQueue connect_buffer_;
+    std::atomic<bool> uplink_held_{false};
+    std::mutex stop_listening_mutex_;
+    bool stop_listening_queued_ = false;
+    UplinkStats uplink_stats_;
+    UplinkController uplink_controller_;
+    VadGate vad_gate_;
+    EndpointDetector endpoint_detector_;
+    std::atomic<bool> endpoint_reached_{false};
+    uint32_t last_reported_gate_frames_ = 0;
+    // Polled by signal_quality_task_handle_, on ML307 the query is a blocking AT round trip
+    std::atomic<int> signal_quality_{-1};
+    TaskHandle_t signal_quality_task_handle_ = nullptr;
+    uint32_t link_send_count_ = 0;
+    uint32_t link_send_total_us_ = 0;
+    uint32_t link_send_drops_ = 0;
+    uint32_t link_received_ = 0;
+    uint32_t link_lost_ = 0;
+    TaskHandle_t audio_send_task_handle_ = nullptr;
+    uint32_t last_reported_send_drops_ = 0;
+    Protocol::AudioWriteStats last_reported_audio_writes_ = {};
+    int32_t last_capture_allocations_ = 0;
+    int32_t last_encode_allocations_ = 0;
+
+    // Scratch buffers for ReadAudio, sized on first use and reused afterwards
+    std::vector<int16_t> read_buffer_;
+    std::vector<int16_t> mic_channel_;
+    std::vector<int16_t> reference_channel_;
+    std::vector<int16_t> resampled_mic_;
+    std::vector<int16_t> resampled_reference_;
 
-    std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
-    std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
+    std::unique_ptr<OpusStreamEncoder> opus_encoder_;
+    struct DecoderSlot {
+        int stream_sample_rate;
+        int frame_duration;
+        std::unique_ptr<OpusDecoderWrapper> decoder;
+    };
+    std::vector<DecoderSlot> opus_decoders_; // most recently used last
+    OpusDecoderWrapper* opus_decoder_ = nullptr;
+    int output_resampler_rate_ = 0;
 
+    CaptureResampler capture_resampler_;
     OpusResampler input_resampler_;
     OpusResampler reference_resampler_;
     OpusResampler output_resampler_;
 
     void MainLoop();
     void OnAudioInput();
-    void OnAudioOutput();
-    void ReadAudio(std::vector<int16_t>& data, int sample_rate, int samples);
+    void AudioDecodeTask();
+    void AudioOutputTask();
+    bool PullDecodeFrame(std::vector<uint8_t>& opus);
+    void WaitForPlayback();
+    void ReadAudio(PcmFrameRef& frame, int sample_rate, int samples);
+    void QueueEncode(PcmFrameRef&& frame);
+    void AudioEncodeTask();
+    void AudioSendTask();
+    // The stop follows the packets still in audio_send_queue_, the send task raises it
+    void QueueStopListening();
+    void SendQueuedStopListening();
+    void UpdateUplinkProfile();
+    void SignalQualityTask();
+    void StartCaptureBeforeConnect(ListeningMode mode);
+    void ConnectAndListen(ListeningMode mode, std::function<void()> on_opened = nullptr);
     void ResetDecoder();
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
     void CheckNewVersion();
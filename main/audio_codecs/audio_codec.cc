@@ -19,8 +19,11 @@ void AudioCodec::OutputData(std::vector<int16_t>& data) {
 }
 
 bool AudioCodec::InputData(std::vector<int16_t>& data) {
-    int samples = Read(data.data(), data.size());
-    if (samples > 0) {
+    return InputData(data.data(), data.size());
+}
+
+bool AudioCodec::InputData(int16_t* data, int samples) {
+    if (Read(data, samples) > 0) {
         return true;
     }
     return false;
@@ -23,6 +23,7 @@ public:
     void Start();
     void OutputData(std::vector<int16_t>& data);
     bool InputData(std::vector<int16_t>& data);
+    bool InputData(int16_t* data, int samples);
 
     inline bool duplex() const { return duplex_; }
     inline bool input_reference() const { return input_reference_; }
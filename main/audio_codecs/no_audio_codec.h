@@ -8,6 +8,12 @@
 
 class NoAudioCodec : public AudioCodec {
 private:
+    // 32bit I2S slot buffers, reused across calls
+    std::vector<int32_t> read_buffer_;
+    std::vector<int32_t> write_buffer_;
+    int gain_volume_ = -1;
+    int32_t gain_q16_ = 0;
+
     virtual int Write(const int16_t* data, int samples) override;
     virtual int Read(int16_t* dest, int samples) override;
 
@@ -0,0 +1,82 @@
+#include "sample_convert.h"
+
+// The loops are unrolled with branchless clamps. On Xtensa GCC lowers the paired
+// compares to MIN/MAX so no loop body has a branch, and the unrolling hides the
+// load-use latency of the loads.
+
+__attribute__((always_inline)) static inline int16_t Saturate16(int32_t value) {
+    value = value < -INT16_MAX ? -INT16_MAX : value;
+    value = value > INT16_MAX ? INT16_MAX : value;
+    return (int16_t)value;
+}
+
+// Blocks of 8 with a fixed trip count. GCC vectorizes a block at -O2 where the target has
+// vector min/max, and the unroll pragma keeps -Os and -Og from falling back to a rolled loop.
+// The earlier unrolled-by-4 body was not vectorized and measured slower than the plain loop.
+void ConvertInt32ToInt16(const int32_t* src, int16_t* dest, size_t samples, int shift) {
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+#pragma GCC unroll 8
+        for (int k = 0; k < 8; k++) {
+            dest[i + k] = Saturate16(src[i + k] >> shift);
+        }
+    }
+    for (; i < samples; i++) {
+        dest[i] = Saturate16(src[i] >> shift);
+    }
+}
+
+void ConvertInt16ToInt32(const int16_t* src, int32_t* dest, size_t samples, int32_t gain_q16) {
+    // 32767 * 65536 still fits in int32, clamping the gain is enough to avoid overflow
+    gain_q16 = gain_q16 < 0 ? 0 : gain_q16;
+    gain_q16 = gain_q16 > 65536 ? 65536 : gain_q16;
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        dest[i] = src[i] * gain_q16;
+        dest[i + 1] = src[i + 1] * gain_q16;
+        dest[i + 2] = src[i + 2] * gain_q16;
+        dest[i + 3] = src[i + 3] * gain_q16;
+    }
+    for (; i < samples; i++) {
+        dest[i] = src[i] * gain_q16;
+    }
+}
+
+void DeinterleaveStereo(const int16_t* src, int16_t* left, int16_t* right, size_t frames) {
+    size_t i = 0;
+    for (; i + 2 <= frames; i += 2) {
+        int16_t l0 = src[0], r0 = src[1], l1 = src[2], r1 = src[3];
+        left[i] = l0;
+        right[i] = r0;
+        left[i + 1] = l1;
+        right[i + 1] = r1;
+        src += 4;
+    }
+    for (; i < frames; i++) {
+        left[i] = src[0];
+        right[i] = src[1];
+        src += 2;
+    }
+}
+
+void InterleaveStereo(const int16_t* left, const int16_t* right, int16_t* dest, size_t frames) {
+    size_t i = 0;
+    for (; i + 2 <= frames; i += 2) {
+        dest[0] = left[i];
+        dest[1] = right[i];
+        dest[2] = left[i + 1];
+        dest[3] = right[i + 1];
+        dest += 4;
+    }
+    for (; i < frames; i++) {
+        dest[0] = left[i];
+        dest[1] = right[i];
+        dest += 2;
+    }
+}
+
+int32_t VolumeToGainQ16(int volume) {
+    volume = volume < 0 ? 0 : volume;
+    volume = volume > 100 ? 100 : volume;
+    return volume * volume * 65536 / 10000;
+}
@@ -0,0 +1,26 @@
+#ifndef _SAMPLE_CONVERT_H
+#define _SAMPLE_CONVERT_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Sample format kernels shared by the codec read/write paths and the capture path.
+// All kernels accept unaligned buffers and any length; src and dest must not overlap
+// unless noted otherwise.
+
+// dest[i] = clamp(src[i] >> shift, -32767, 32767), used for 32bit I2S slots carrying 24bit or less
+// samples. The lower bound is -INT16_MAX to match the original read loop, so the output stays symmetric.
+void ConvertInt32ToInt16(const int32_t* src, int16_t* dest, size_t samples, int shift);
+
+// dest[i] = src[i] * gain_q16, gain_q16 in [0, 65536]. The product never overflows int32
+// so this doubles as int16 -> int32 slot packing with volume.
+void ConvertInt16ToInt32(const int16_t* src, int32_t* dest, size_t samples, int32_t gain_q16);
+
+// Split interleaved stereo frames into two planes and back
+void DeinterleaveStereo(const int16_t* src, int16_t* left, int16_t* right, size_t frames);
+void InterleaveStereo(const int16_t* left, const int16_t* right, int16_t* dest, size_t frames);
+
+// Q16 gain for a 0-100 volume, squared for a perceptually even curve
+int32_t VolumeToGainQ16(int volume);
+
+#endif // _SAMPLE_CONVERT_H
@@ -0,0 +1,163 @@
+// Host check and benchmark for the sample conversion kernels, not part of the firmware build.
+// Compares every kernel with the loops it replaced, then times both on the same buffers.
+//
+//   g++ -O2 -std=c++17 -o /tmp/sample_convert_test main/audio_codecs/sample_convert.cc main/audio_codecs/sample_convert_test.cc
+//   /tmp/sample_convert_test
+
+#include "sample_convert.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// The loops NoAudioCodec and Application::ReadAudio used before the kernels. Kept out of line
+// like the kernels in their own translation unit, so both are timed as real calls.
+
+__attribute__((noinline)) static void ReferenceReadSlots(const int32_t* src, int16_t* dest, size_t samples) {
+    for (size_t i = 0; i < samples; i++) {
+        int32_t value = src[i] >> 12;
+        dest[i] = (value > INT16_MAX) ? INT16_MAX : (value < -INT16_MAX) ? -INT16_MAX : (int16_t)value;
+    }
+}
+
+static int32_t ReferenceVolumeFactor(int volume) {
+    return pow(double(volume) / 100.0, 2) * 65536;
+}
+
+__attribute__((noinline)) static void ReferenceWriteSlots(const int16_t* src, int32_t* dest, size_t samples, int32_t volume_factor) {
+    for (size_t i = 0; i < samples; i++) {
+        int64_t temp = int64_t(src[i]) * volume_factor;
+        if (temp > INT32_MAX) {
+            dest[i] = INT32_MAX;
+        } else if (temp < INT32_MIN) {
+            dest[i] = INT32_MIN;
+        } else {
+            dest[i] = static_cast<int32_t>(temp);
+        }
+    }
+}
+
+__attribute__((noinline)) static void ReferenceDeinterleave(const int16_t* src, int16_t* left, int16_t* right, size_t frames) {
+    for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+        left[i] = src[j];
+        right[i] = src[j + 1];
+    }
+}
+
+__attribute__((noinline)) static void ReferenceInterleave(const int16_t* left, const int16_t* right, int16_t* dest, size_t frames) {
+    for (size_t i = 0, j = 0; i < frames; ++i, j += 2) {
+        dest[j] = left[i];
+        dest[j + 1] = right[i];
+    }
+}
+
+static int failures = 0;
+
+static void Expect(bool condition, const char* what, size_t length) {
+    if (!condition) {
+        printf("FAIL %s (length %zu)\n", what, length);
+        failures++;
+    }
+}
+
+template <typename F>
+static double TimeNs(F&& body, int rounds) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        body();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / rounds;
+}
+
+int main() {
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int32_t> any32(INT32_MIN, INT32_MAX);
+    std::uniform_int_distribution<int> any16(INT16_MIN, INT16_MAX);
+
+    // Odd lengths exercise the tails after the unrolled bodies, +1 offsets the unaligned cases
+    for (size_t length : {0, 1, 2, 3, 4, 5, 7, 8, 9, 31, 960, 961, 1923}) {
+        std::vector<int32_t> slots(length + 1);
+        for (auto& value : slots) {
+            value = any32(rng);
+        }
+        if (length >= 4) {
+            slots[1] = INT32_MIN;
+            slots[2] = INT32_MAX;
+            slots[3] = -(32768 << 12);
+            slots[4] = 32767 << 12;
+        }
+        std::vector<int16_t> expected(length + 1), actual(length + 1);
+        for (int offset = 0; offset <= 1 && offset <= (int)length; offset++) {
+            size_t samples = length - offset;
+            ReferenceReadSlots(slots.data() + offset, expected.data() + offset, samples);
+            ConvertInt32ToInt16(slots.data() + offset, actual.data() + offset, samples, 12);
+            Expect(memcmp(expected.data() + offset, actual.data() + offset, samples * sizeof(int16_t)) == 0,
+                "ConvertInt32ToInt16", samples);
+        }
+
+        std::vector<int16_t> pcm(length * 2 + 1);
+        for (auto& value : pcm) {
+            value = any16(rng);
+        }
+        if (length >= 2) {
+            pcm[0] = INT16_MIN;
+            pcm[1] = INT16_MAX;
+        }
+        std::vector<int32_t> expected32(length), actual32(length);
+        for (int volume = 0; volume <= 100; volume++) {
+            Expect(ReferenceVolumeFactor(volume) == VolumeToGainQ16(volume), "VolumeToGainQ16", volume);
+            ReferenceWriteSlots(pcm.data(), expected32.data(), length, ReferenceVolumeFactor(volume));
+            ConvertInt16ToInt32(pcm.data(), actual32.data(), length, VolumeToGainQ16(volume));
+            Expect(expected32 == actual32, "ConvertInt16ToInt32", length);
+        }
+
+        std::vector<int16_t> left(length), right(length), expected_left(length), expected_right(length);
+        ReferenceDeinterleave(pcm.data() + 1, expected_left.data(), expected_right.data(), length);
+        DeinterleaveStereo(pcm.data() + 1, left.data(), right.data(), length);
+        Expect(left == expected_left && right == expected_right, "DeinterleaveStereo", length);
+
+        std::vector<int16_t> expected_stereo(length * 2), stereo(length * 2);
+        ReferenceInterleave(left.data(), right.data(), expected_stereo.data(), length);
+        InterleaveStereo(left.data(), right.data(), stereo.data(), length);
+        Expect(stereo == expected_stereo, "InterleaveStereo", length);
+    }
+    printf("%s\n", failures == 0 ? "All kernels match the reference loops" : "Kernels differ from the reference loops");
+
+    // One 60ms frame at 16kHz stereo, the size the codec paths handle per call
+    const size_t frames = 960;
+    const int rounds = 20000;
+    std::vector<int32_t> slots(frames * 2);
+    std::vector<int16_t> pcm(frames * 2), left(frames), right(frames), out16(frames * 2);
+    std::vector<int32_t> out32(frames * 2);
+    for (auto& value : slots) {
+        value = any32(rng);
+    }
+    for (auto& value : pcm) {
+        value = any16(rng);
+    }
+    int32_t gain = VolumeToGainQ16(70);
+
+    struct Row {
+        const char* name;
+        double before;
+        double after;
+    } rows[] = {
+        {"int32 -> int16", TimeNs([&] { ReferenceReadSlots(slots.data(), out16.data(), slots.size()); }, rounds),
+            TimeNs([&] { ConvertInt32ToInt16(slots.data(), out16.data(), slots.size(), 12); }, rounds)},
+        {"int16 -> int32", TimeNs([&] { ReferenceWriteSlots(pcm.data(), out32.data(), pcm.size(), gain); }, rounds),
+            TimeNs([&] { ConvertInt16ToInt32(pcm.data(), out32.data(), pcm.size(), gain); }, rounds)},
+        {"deinterleave", TimeNs([&] { ReferenceDeinterleave(pcm.data(), left.data(), right.data(), frames); }, rounds),
+            TimeNs([&] { DeinterleaveStereo(pcm.data(), left.data(), right.data(), frames); }, rounds)},
+        {"interleave", TimeNs([&] { ReferenceInterleave(left.data(), right.data(), out16.data(), frames); }, rounds),
+            TimeNs([&] { InterleaveStereo(left.data(), right.data(), out16.data(), frames); }, rounds)},
+    };
+    printf("%-16s %12s %12s  (ns per %zu frame stereo buffer, host)\n", "kernel", "before", "after", frames);
+    for (auto& row : rows) {
+        printf("%-16s %12.0f %12.0f\n", row.name, row.before, row.after);
+    }
+    return failures == 0 ? 0 : 1;
+}
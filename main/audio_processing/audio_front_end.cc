@@ -0,0 +1,171 @@
+#include "audio_front_end.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <esp_nsn_models.h>
+#include <string>
+
+static const char* TAG = "AudioFrontEnd";
+
+AudioFrontEnd::~AudioFrontEnd() {
+    if (afe_data_ != nullptr) {
+        afe_iface_->destroy(afe_data_);
+    }
+}
+
+void AudioFrontEnd::Initialize(AudioCodec* codec, bool realtime_chat) {
+    codec_ = codec;
+    realtime_chat_ = realtime_chat;
+    int ref_num = codec_->input_reference() ? 1 : 0;
+
+    std::string input_format;
+    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
+        input_format.push_back('M');
+    }
+    for (int i = 0; i < ref_num; i++) {
+        input_format.push_back('R');
+    }
+
+    size_t psram_before = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    models_ = esp_srmodel_init("model");
+    for (int i = 0; i < models_->num; i++) {
+        ESP_LOGI(TAG, "Model %d: %s", i, models_->model_name[i]);
+    }
+    char* ns_model_name = esp_srmodel_filter(models_, ESP_NSNET_PREFIX, NULL);
+
+#if CONFIG_USE_WAKE_WORD_DETECT
+    // WakeNet only runs in the SR pipeline
+    afe_config_t* afe_config = afe_config_init(input_format.c_str(), models_, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
+    has_wakenet_ = afe_config->wakenet_init;
+#else
+    afe_config_t* afe_config = afe_config_init(input_format.c_str(), NULL, AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
+#endif
+    // AEC stays on whenever the board loops the speaker back, it protects both consumers
+    afe_config->aec_init = codec_->input_reference();
+    afe_config->aec_mode = realtime_chat ? AEC_MODE_VOIP_HIGH_PERF : AEC_MODE_SR_HIGH_PERF;
+#if CONFIG_USE_AUDIO_PROCESSOR
+    has_ns_ = ns_model_name != NULL;
+    afe_config->ns_init = has_ns_;
+    afe_config->ns_model_name = ns_model_name;
+    afe_config->afe_ns_mode = AFE_NS_MODE_NET;
+    afe_config->vad_init = true;
+    afe_config->vad_mode = VAD_MODE_0;
+    afe_config->vad_min_noise_ms = 100;
+#else
+    afe_config->ns_init = false;
+    afe_config->vad_init = false;
+#endif
+    afe_config->agc_init = false;
+    afe_config->afe_perferred_core = 1;
+    afe_config->afe_perferred_priority = 1;
+    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
+
+    afe_iface_ = esp_afe_handle_from_config(afe_config);
+    afe_data_ = afe_iface_->create_from_config(afe_config);
+
+    // Every stage starts off, the consumers turn on what their state needs
+    wakenet_enabled_ = has_wakenet_;
+    ns_enabled_ = has_ns_;
+    vad_enabled_ = afe_config->vad_init;
+    EnableWakeNet(false);
+    EnableNs(false);
+    EnableVad(false);
+    switch_time_ = 0;
+
+    ESP_LOGI(TAG, "AFE created: wakenet %d, ns %d, aec %d, PSRAM used %u bytes (models and pipeline)",
+        has_wakenet_, has_ns_, afe_config->aec_init,
+        psram_before - heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+}
+
+void AudioFrontEnd::AddConsumer(std::function<void(const afe_fetch_result_t* result)> consumer) {
+    consumers_.push_back(consumer);
+}
+
+void AudioFrontEnd::Start() {
+    xTaskCreate([](void* arg) {
+        auto this_ = (AudioFrontEnd*)arg;
+        this_->FetchTask();
+        vTaskDelete(NULL);
+    }, "audio_front_end", 4096, this, 3, &fetch_task_);
+}
+
+void AudioFrontEnd::Feed(const PcmFrameRef& frame) {
+    afe_iface_->feed(afe_data_, frame.data());
+}
+
+size_t AudioFrontEnd::GetFeedSize() {
+    return afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
+}
+
+void AudioFrontEnd::EnableWakeNet(bool enable) {
+    if (!has_wakenet_ || wakenet_enabled_ == enable) {
+        return;
+    }
+    wakenet_enabled_ = enable;
+    if (enable) {
+        afe_iface_->enable_wakenet(afe_data_);
+    } else {
+        afe_iface_->disable_wakenet(afe_data_);
+    }
+    MarkSwitch();
+}
+
+void AudioFrontEnd::EnableNs(bool enable) {
+    if (!has_ns_ || ns_enabled_ == enable) {
+        return;
+    }
+    ns_enabled_ = enable;
+    if (enable) {
+        afe_iface_->enable_ns(afe_data_);
+    } else {
+        afe_iface_->disable_ns(afe_data_);
+    }
+    MarkSwitch();
+}
+
+void AudioFrontEnd::EnableVad(bool enable) {
+    if (vad_enabled_ == enable) {
+        return;
+    }
+    vad_enabled_ = enable;
+    if (enable) {
+        afe_iface_->enable_vad(afe_data_);
+    } else {
+        afe_iface_->disable_vad(afe_data_);
+    }
+    MarkSwitch();
+}
+
+void AudioFrontEnd::MarkSwitch() {
+    int64_t expected = 0;
+    switch_time_.compare_exchange_strong(expected, esp_timer_get_time());
+}
+
+void AudioFrontEnd::FetchTask() {
+    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
+    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
+    ESP_LOGI(TAG, "Audio front end task started, feed size: %d fetch size: %d",
+        feed_size, fetch_size);
+
+    while (true) {
+        // Blocks while nobody feeds, no need for a running flag
+        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
+        if (res == nullptr || res->ret_value == ESP_FAIL) {
+            if (res != nullptr) {
+                ESP_LOGI(TAG, "Error code: %d", res->ret_value);
+            }
+            continue;
+        }
+
+        // Gap between a state switch and the first result the new state sees
+        int64_t switch_time = switch_time_.exchange(0);
+        if (switch_time != 0) {
+            ESP_LOGI(TAG, "Stage switch gap: %lld us", esp_timer_get_time() - switch_time);
+        }
+
+        for (auto& consumer : consumers_) {
+            consumer(res);
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef AUDIO_FRONT_END_H
+#define AUDIO_FRONT_END_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_afe_sr_models.h>
+#include <model_path.h>
+
+#include <vector>
+#include <functional>
+#include <atomic>
+
+#include "audio_codec.h"
+#include "pcm_frame_pool.h"
+
+// The one AFE instance on the device, shared by wake word detection and speech processing.
+// Built once from one model list; WakeNet, NS and VAD are switched per device state with the
+// AFE enable/disable calls instead of resetting or re-creating the pipeline. A single fetch
+// task hands every result to all consumers, each consumer ignores results while it is stopped.
+class AudioFrontEnd {
+public:
+    AudioFrontEnd() = default;
+    ~AudioFrontEnd();
+    AudioFrontEnd(const AudioFrontEnd&) = delete;
+    AudioFrontEnd& operator=(const AudioFrontEnd&) = delete;
+
+    void Initialize(AudioCodec* codec, bool realtime_chat);
+    // Register consumers before Start, the list is not locked against the fetch task
+    void AddConsumer(std::function<void(const afe_fetch_result_t* result)> consumer);
+    void Start();
+    void Feed(const PcmFrameRef& frame);
+    size_t GetFeedSize();
+
+    void EnableWakeNet(bool enable);
+    void EnableNs(bool enable);
+    void EnableVad(bool enable);
+
+    srmodel_list_t* models() const { return models_; }
+    bool realtime_chat() const { return realtime_chat_; }
+
+private:
+    AudioCodec* codec_ = nullptr;
+    srmodel_list_t* models_ = nullptr;
+    esp_afe_sr_iface_t* afe_iface_ = nullptr;
+    esp_afe_sr_data_t* afe_data_ = nullptr;
+    bool realtime_chat_ = false;
+    bool has_wakenet_ = false;
+    bool has_ns_ = false;
+    bool wakenet_enabled_ = false;
+    bool ns_enabled_ = false;
+    bool vad_enabled_ = false;
+    std::vector<std::function<void(const afe_fetch_result_t* result)>> consumers_;
+    TaskHandle_t fetch_task_ = nullptr;
+
+    // Time of the last stage switch, cleared by the fetch task once the next result is out
+    std::atomic<int64_t> switch_time_{0};
+
+    void MarkSwitch();
+    void FetchTask();
+};
+
+#endif
@@ -1,93 +1,42 @@
 #include "audio_processor.h"
-#include <esp_log.h>
+#include <cstring>
 
 #define PROCESSOR_RUNNING 0x01
 
-static const char* TAG = "AudioProcessor";
-
-AudioProcessor::AudioProcessor()
-    : afe_data_(nullptr) {
+AudioProcessor::AudioProcessor() {
     event_group_ = xEventGroupCreate();
 }
 
-void AudioProcessor::Initialize(AudioCodec* codec, bool realtime_chat) {
-    codec_ = codec;
-    int ref_num = codec_->input_reference() ? 1 : 0;
-
-    std::string input_format;
-    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
-        input_format.push_back('M');
-    }
-    for (int i = 0; i < ref_num; i++) {
-        input_format.push_back('R');
-    }
-
-    srmodel_list_t *models = esp_srmodel_init("model");
-    char* ns_model_name = esp_srmodel_filter(models, ESP_NSNET_PREFIX, NULL);
-
-    afe_config_t* afe_config = afe_config_init(input_format.c_str(), NULL, AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
-    if (realtime_chat) {
-        afe_config->aec_init = true;
-        afe_config->aec_mode = AEC_MODE_VOIP_HIGH_PERF;
-    } else {
-        afe_config->aec_init = false;
-    }
-    afe_config->ns_init = true;
-    afe_config->ns_model_name = ns_model_name;
-    afe_config->afe_ns_mode = AFE_NS_MODE_NET;
-    if (realtime_chat) {
-        afe_config->vad_init = false;
-    } else {
-        afe_config->vad_init = true;
-        afe_config->vad_mode = VAD_MODE_0;
-        afe_config->vad_min_noise_ms = 100;
-    }
-    afe_config->afe_perferred_core = 1;
-    afe_config->afe_perferred_priority = 1;
-    afe_config->agc_init = false;
-    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
-
-    afe_iface_ = esp_afe_handle_from_config(afe_config);
-    afe_data_ = afe_iface_->create_from_config(afe_config);
-    
-    xTaskCreate([](void* arg) {
-        auto this_ = (AudioProcessor*)arg;
-        this_->AudioProcessorTask();
-        vTaskDelete(NULL);
-    }, "audio_communication", 4096, this, 3, NULL);
-}
-
 AudioProcessor::~AudioProcessor() {
-    if (afe_data_ != nullptr) {
-        afe_iface_->destroy(afe_data_);
-    }
     vEventGroupDelete(event_group_);
 }
 
-size_t AudioProcessor::GetFeedSize() {
-    return afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
-}
-
-void AudioProcessor::Feed(const std::vector<int16_t>& data) {
-    afe_iface_->feed(afe_data_, data.data());
+void AudioProcessor::Initialize(AudioFrontEnd* front_end) {
+    front_end_ = front_end;
+    front_end_->AddConsumer([this](const afe_fetch_result_t* res) {
+        OnFetchResult(res);
+    });
 }
 
 void AudioProcessor::Start() {
+    // Realtime mode gates the uplink itself, the AFE VAD stays off there
+    front_end_->EnableNs(true);
+    front_end_->EnableVad(!front_end_->realtime_chat());
+    is_speaking_ = false;
     xEventGroupSetBits(event_group_, PROCESSOR_RUNNING);
 }
 
 void AudioProcessor::Stop() {
     xEventGroupClearBits(event_group_, PROCESSOR_RUNNING);
-    if (afe_data_ != nullptr) {
-        afe_iface_->reset_buffer(afe_data_);
-    }
+    front_end_->EnableNs(false);
+    front_end_->EnableVad(false);
 }
 
 bool AudioProcessor::IsRunning() {
     return xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING;
 }
 
-void AudioProcessor::OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) {
+void AudioProcessor::OnOutput(std::function<void(PcmFrameRef&& frame)> callback) {
     output_callback_ = callback;
 }
 
@@ -95,39 +44,29 @@ void AudioProcessor::OnVadStateChange(std::function<void(bool speaking)> callbac
     vad_state_change_callback_ = callback;
 }
 
-void AudioProcessor::AudioProcessorTask() {
-    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
-    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
-    ESP_LOGI(TAG, "Audio communication task started, feed size: %d fetch size: %d",
-        feed_size, fetch_size);
-
-    while (true) {
-        xEventGroupWaitBits(event_group_, PROCESSOR_RUNNING, pdFALSE, pdTRUE, portMAX_DELAY);
-
-        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
-        if ((xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING) == 0) {
-            continue;
-        }
-        if (res == nullptr || res->ret_value == ESP_FAIL) {
-            if (res != nullptr) {
-                ESP_LOGI(TAG, "Error code: %d", res->ret_value);
-            }
-            continue;
-        }
+void AudioProcessor::OnFetchResult(const afe_fetch_result_t* res) {
+    if (!IsRunning()) {
+        return;
+    }
 
-        // VAD state change
-        if (vad_state_change_callback_) {
-            if (res->vad_state == VAD_SPEECH && !is_speaking_) {
-                is_speaking_ = true;
-                vad_state_change_callback_(true);
-            } else if (res->vad_state == VAD_SILENCE && is_speaking_) {
-                is_speaking_ = false;
-                vad_state_change_callback_(false);
-            }
+    // VAD state change
+    if (vad_state_change_callback_) {
+        if (res->vad_state == VAD_SPEECH && !is_speaking_) {
+            is_speaking_ = true;
+            vad_state_change_callback_(true);
+        } else if (res->vad_state == VAD_SILENCE && is_speaking_) {
+            is_speaking_ = false;
+            vad_state_change_callback_(false);
         }
+    }
 
-        if (output_callback_) {
-            output_callback_(std::vector<int16_t>(res->data, res->data + res->data_size / sizeof(int16_t)));
+    if (output_callback_) {
+        // The AFE reuses its output buffer, copy it into a pooled frame
+        auto frame = PcmFramePool::GetInstance().Acquire(res->data_size / sizeof(int16_t));
+        if (!frame) {
+            return;
         }
+        memcpy(frame.data(), res->data, res->data_size);
+        output_callback_(std::move(frame));
     }
 }
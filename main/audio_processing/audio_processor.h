@@ -1,7 +1,6 @@
 #ifndef AUDIO_PROCESSOR_H
 #define AUDIO_PROCESSOR_H
 
-#include <esp_afe_sr_models.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
@@ -10,32 +9,30 @@
 #include <vector>
 #include <functional>
 
-#include "audio_codec.h"
+#include "audio_front_end.h"
 
 class AudioProcessor {
 public:
     AudioProcessor();
     ~AudioProcessor();
 
-    void Initialize(AudioCodec* codec, bool realtime_chat);
-    void Feed(const std::vector<int16_t>& data);
+    void Initialize(AudioFrontEnd* front_end);
     void Start();
     void Stop();
     bool IsRunning();
-    void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback);
+    // VAD decision for the frame being handed to the output callback
+    bool is_speaking() const { return is_speaking_; }
+    void OnOutput(std::function<void(PcmFrameRef&& frame)> callback);
     void OnVadStateChange(std::function<void(bool speaking)> callback);
-    size_t GetFeedSize();
 
 private:
     EventGroupHandle_t event_group_ = nullptr;
-    esp_afe_sr_iface_t* afe_iface_ = nullptr;
-    esp_afe_sr_data_t* afe_data_ = nullptr;
-    std::function<void(std::vector<int16_t>&& data)> output_callback_;
+    AudioFrontEnd* front_end_ = nullptr;
+    std::function<void(PcmFrameRef&& frame)> output_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
-    AudioCodec* codec_ = nullptr;
     bool is_speaking_ = false;
 
-    void AudioProcessorTask();
+    void OnFetchResult(const afe_fetch_result_t* res);
 };
 
 #endif
@@ -0,0 +1,110 @@
+#include "capture_resampler.h"
+
+#include <esp_log.h>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <algorithm>
+
+#define TAG "CaptureResampler"
+
+// Filter length in taps at the upsampled rate per unit of the larger of L and M. With the
+// cutoff below, the Blackman transition ends at the output nyquist: -0.2 dB at 5.5 kHz,
+// -1.9 dB at 6 kHz, at least 71 dB down from 8 kHz on, for all three ratios.
+#define TAPS_PER_FACTOR 32
+// -6 dB point as a fraction of the output rate
+#define CUTOFF_RATIO 0.40
+#define MAX_UP_FACTOR 4
+#define MAX_DOWN_FACTOR 6
+
+bool CaptureResampler::Configure(int input_rate, int output_rate, int channels) {
+    channels_ = 0;
+    int divisor = std::gcd(input_rate, output_rate);
+    int up = output_rate / divisor;
+    int down = input_rate / divisor;
+    if (channels < 1 || channels > 2 || up >= down || up > MAX_UP_FACTOR || down > MAX_DOWN_FACTOR) {
+        return false;
+    }
+
+    up_ = up;
+    down_ = down;
+    taps_ = TAPS_PER_FACTOR * down / up;
+    int length = taps_ * up_;
+
+    // Windowed sinc at the upsampled rate, nothing above the output nyquist may fold back
+    double cutoff = CUTOFF_RATIO * output_rate / (double(input_rate) * up_);
+    double center = (length - 1) / 2.0;
+    std::vector<double> h(length);
+    double sum = 0;
+    for (int i = 0; i < length; i++) {
+        double x = i - center;
+        double sinc = x == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+        double window = 0.42 - 0.5 * cos(2 * M_PI * i / (length - 1)) + 0.08 * cos(4 * M_PI * i / (length - 1));
+        h[i] = sinc * window;
+        sum += h[i];
+    }
+
+    // Unity gain per phase, stored phase-major and reversed so the inner loop walks forward in time
+    coefficients_.assign(length, 0);
+    for (int p = 0; p < up_; p++) {
+        for (int k = 0; k < taps_; k++) {
+            double value = h[p + k * up_] * up_ / sum;
+            coefficients_[p * taps_ + (taps_ - 1 - k)] = (int16_t)lround(std::clamp(value * 32768.0, -32768.0, 32767.0));
+        }
+    }
+
+    channels_ = channels;
+    Reset();
+    ESP_LOGI(TAG, "%d -> %d Hz, %d channels, %d taps x %d phases", input_rate, output_rate, channels, taps_, up_);
+    return true;
+}
+
+void CaptureResampler::Reset() {
+    phase_ = 0;
+    work_.assign((taps_ - 1) * channels_, 0);
+}
+
+size_t CaptureResampler::GetOutputFrames(size_t input_frames) const {
+    size_t end = input_frames * up_;
+    return phase_ < end ? (end - phase_ + down_ - 1) / down_ : 0;
+}
+
+size_t CaptureResampler::Process(const int16_t* input, size_t input_frames, int16_t* output, size_t max_output_frames) {
+    size_t history = (taps_ - 1) * channels_;
+    work_.resize(history + input_frames * channels_);
+    memcpy(work_.data() + history, input, input_frames * channels_ * sizeof(int16_t));
+
+    size_t produced = 0;
+    size_t end = input_frames * up_;
+    for (; phase_ < end; phase_ += down_) {
+        if (produced == max_output_frames) {
+            continue;
+        }
+        // Oldest tap first: frame (phase_ / L) of the block is the newest sample in the window
+        const int16_t* x = work_.data() + (phase_ / up_) * channels_;
+        const int16_t* c = coefficients_.data() + (phase_ % up_) * taps_;
+        if (channels_ == 2) {
+            int32_t left = 0, right = 0;
+            for (int k = 0; k < taps_; k++) {
+                left += x[0] * c[k];
+                right += x[1] * c[k];
+                x += 2;
+            }
+            output[0] = (int16_t)std::clamp((left + (1 << 14)) >> 15, (int32_t)INT16_MIN, (int32_t)INT16_MAX);
+            output[1] = (int16_t)std::clamp((right + (1 << 14)) >> 15, (int32_t)INT16_MIN, (int32_t)INT16_MAX);
+            output += 2;
+        } else {
+            int32_t acc = 0;
+            for (int k = 0; k < taps_; k++) {
+                acc += x[k] * c[k];
+            }
+            *output++ = (int16_t)std::clamp((acc + (1 << 14)) >> 15, (int32_t)INT16_MIN, (int32_t)INT16_MAX);
+        }
+        produced++;
+    }
+    phase_ -= end;
+
+    // Keep the newest taps_ - 1 frames as history for the next block
+    memmove(work_.data(), work_.data() + input_frames * channels_, history * sizeof(int16_t));
+    return produced;
+}
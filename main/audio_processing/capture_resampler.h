@@ -0,0 +1,38 @@
+#ifndef CAPTURE_RESAMPLER_H
+#define CAPTURE_RESAMPLER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Polyphase FIR resampler for small rational downsampling ratios (48k->16k, 24k->16k, 32k->16k).
+// Works on interleaved frames of one or two channels, so mic + reference from the I2S slots
+// are filtered in a single pass and come out interleaved, ready for the AFE.
+class CaptureResampler {
+public:
+    CaptureResampler() = default;
+    CaptureResampler(const CaptureResampler&) = delete;
+    CaptureResampler& operator=(const CaptureResampler&) = delete;
+
+    // Returns false if the ratio has no fast path, the caller should fall back to OpusResampler
+    bool Configure(int input_rate, int output_rate, int channels);
+    void Reset();
+    // Number of output frames produced for the given input frames, exact while the phase stays aligned
+    size_t GetOutputFrames(size_t input_frames) const;
+    // Consumes all input frames and writes at most max_output_frames, returns frames written
+    size_t Process(const int16_t* input, size_t input_frames, int16_t* output, size_t max_output_frames);
+
+    inline bool configured() const { return channels_ > 0; }
+    inline int channels() const { return channels_; }
+
+private:
+    int channels_ = 0;
+    int up_ = 1;      // L, interpolation factor
+    int down_ = 1;    // M, decimation factor
+    int taps_ = 0;    // taps per phase
+    size_t phase_ = 0; // position of the next output in the upsampled domain, relative to the current block
+    std::vector<int16_t> coefficients_; // [phase][tap], Q15
+    std::vector<int16_t> work_;         // (taps_ - 1) frames of history followed by the current block
+};
+
+#endif // CAPTURE_RESAMPLER_H
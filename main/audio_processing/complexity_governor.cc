@@ -0,0 +1,82 @@
+#include "complexity_governor.h"
+#include "system_info.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <cstring>
+
+#define TAG "ComplexityGovernor"
+
+#define GOVERNOR_WINDOW_MS 5000
+// Core idle share below which we back off, and above which raising is allowed
+#define MIN_IDLE_PERCENT 10
+#define RAISE_IDLE_PERCENT 30
+
+void ComplexityGovernor::Configure(int min_complexity, int max_complexity, int budget_percent) {
+    min_complexity_ = min_complexity;
+    max_complexity_ = max_complexity;
+    budget_percent_ = budget_percent;
+    ResetWindow();
+}
+
+void ComplexityGovernor::ResetWindow() {
+    memset(histogram_, 0, sizeof(histogram_));
+    samples_ = 0;
+    max_us_ = 0;
+    window_audio_ms_ = 0;
+}
+
+uint32_t ComplexityGovernor::Percentile(int percent) const {
+    uint32_t target = (samples_ * percent + 99) / 100;
+    uint32_t count = 0;
+    for (int i = 0; i < ENCODE_HISTOGRAM_BUCKETS; i++) {
+        count += histogram_[i];
+        if (count >= target) {
+            // Upper edge of the bucket, so the estimate errs on the slow side
+            return (i + 1) * ENCODE_HISTOGRAM_BUCKET_US;
+        }
+    }
+    return max_us_;
+}
+
+int ComplexityGovernor::AddSample(uint32_t encode_us, int complexity) {
+    if (!enabled()) {
+        return -1;
+    }
+
+    int bucket = encode_us / ENCODE_HISTOGRAM_BUCKET_US;
+    histogram_[bucket < ENCODE_HISTOGRAM_BUCKETS ? bucket : ENCODE_HISTOGRAM_BUCKETS - 1]++;
+    samples_++;
+    if (encode_us > max_us_) {
+        max_us_ = encode_us;
+    }
+    window_audio_ms_ += frame_duration_ms_;
+    if (window_audio_ms_ < GOVERNOR_WINDOW_MS) {
+        return -1;
+    }
+
+    uint32_t idle_time, total_time;
+    int idle_percent = -1;
+    if (SystemInfo::GetIdleRunTime(xPortGetCoreID(), idle_time, total_time)) {
+        // The first window only takes the baseline
+        if (last_total_time_ != 0 && total_time != last_total_time_) {
+            idle_percent = (uint64_t)(idle_time - last_idle_time_) * 100 / (total_time - last_total_time_);
+        }
+        last_idle_time_ = idle_time;
+        last_total_time_ = total_time;
+    }
+
+    uint32_t budget_us = frame_duration_ms_ * 1000 * budget_percent_ / 100;
+    uint32_t p50 = Percentile(50), p95 = Percentile(95), p99 = Percentile(99);
+    int next = complexity;
+    if ((p95 > budget_us || (idle_percent >= 0 && idle_percent < MIN_IDLE_PERCENT)) && complexity > min_complexity_) {
+        next = complexity - 1;
+    } else if (p95 * 2 < budget_us && (idle_percent < 0 || idle_percent > RAISE_IDLE_PERCENT) && complexity < max_complexity_) {
+        next = complexity + 1;
+    }
+
+    ESP_LOGI(TAG, "Encode %d ms frames: p50 %lu p95 %lu p99 %lu max %lu us, budget %lu us, core %d idle %d%%, complexity %d -> %d",
+        frame_duration_ms_, p50, p95, p99, max_us_, budget_us, xPortGetCoreID(), idle_percent, complexity, next);
+    ResetWindow();
+    return next != complexity ? next : -1;
+}
@@ -0,0 +1,43 @@
+#ifndef COMPLEXITY_GOVERNOR_H
+#define COMPLEXITY_GOVERNOR_H
+
+#include <cstdint>
+#include <cstddef>
+
+// 250us buckets up to 32ms, the last bucket collects everything slower
+#define ENCODE_HISTOGRAM_BUCKETS 128
+#define ENCODE_HISTOGRAM_BUCKET_US 250
+
+// Keeps opus encoding inside a real-time budget. Every window (~5s of audio) it looks at
+// the encode time percentiles and the idle time of the encoding core, and steps the
+// complexity down when over budget or up when there is plenty of headroom.
+class ComplexityGovernor {
+public:
+    ComplexityGovernor() = default;
+
+    // budget_percent: share of the frame duration one encode may take at p95
+    void Configure(int min_complexity, int max_complexity, int budget_percent);
+    void SetFrameDuration(int duration_ms) { frame_duration_ms_ = duration_ms; }
+    // Record one encoded frame, returns the complexity to switch to or -1 to keep the current one
+    int AddSample(uint32_t encode_us, int complexity);
+
+    inline bool enabled() const { return budget_percent_ > 0; }
+
+private:
+    int min_complexity_ = 0;
+    int max_complexity_ = 10;
+    int budget_percent_ = 0;
+    int frame_duration_ms_ = 60;
+
+    uint16_t histogram_[ENCODE_HISTOGRAM_BUCKETS] = {};
+    uint32_t samples_ = 0;
+    uint32_t max_us_ = 0;
+    uint32_t window_audio_ms_ = 0;
+    uint32_t last_idle_time_ = 0;
+    uint32_t last_total_time_ = 0;
+
+    uint32_t Percentile(int percent) const;
+    void ResetWindow();
+};
+
+#endif // COMPLEXITY_GOVERNOR_H
@@ -0,0 +1,84 @@
+#include "endpoint_detector.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "EndpointDetector"
+
+// Speech needed in a turn before trailing silence can end it, coughs and clicks do not count
+#define ENDPOINT_MIN_SPEECH_MS 240
+// Speech below this many times the noise energy (~9 dB) is treated as a noisy room
+#define ENDPOINT_LOW_SNR_RATIO 8
+
+void EndpointDetector::Configure(int sample_rate, int silence_ms, int max_silence_ms) {
+    sample_rate_ = sample_rate;
+    base_silence_ms_ = silence_ms;
+    max_silence_ms_ = max_silence_ms;
+    pause_avg_ms_ = 0;
+    noise_energy_ = 0;
+    speech_energy_ = 0;
+    UpdateThreshold();
+    Reset();
+}
+
+void EndpointDetector::Reset() {
+    speech_ms_ = 0;
+    silence_ms_ = 0;
+    in_speech_ = false;
+    endpointed_ = false;
+}
+
+void EndpointDetector::UpdateThreshold() {
+    int threshold = base_silence_ms_;
+    // Leave room for the pauses this speaker makes between words
+    threshold = std::max(threshold, pause_avg_ms_ * 3 / 2);
+    if (noise_energy_ > 0 && speech_energy_ < noise_energy_ * ENDPOINT_LOW_SNR_RATIO) {
+        threshold += threshold / 2;
+    }
+    threshold_ms_ = std::min(threshold, max_silence_ms_);
+}
+
+bool EndpointDetector::Process(const PcmFrameRef& frame, bool speech) {
+    size_t samples = frame.size();
+    if (samples == 0 || endpointed_) {
+        return false;
+    }
+    int frame_ms = samples * 1000 / sample_rate_;
+    const int16_t* data = frame.data();
+    uint64_t sum = 0;
+    for (size_t i = 0; i < samples; i++) {
+        sum += (int32_t)data[i] * data[i];
+    }
+    uint64_t energy = sum / samples;
+
+    if (speech) {
+        if (!in_speech_ && silence_ms_ > 0) {
+            // Speech resumed inside the turn, learn the pause
+            pause_avg_ms_ = pause_avg_ms_ == 0 ? silence_ms_ : (pause_avg_ms_ * 7 + silence_ms_) / 8;
+            UpdateThreshold();
+        }
+        speech_energy_ = speech_energy_ == 0 ? energy : (speech_energy_ * 15 + energy) / 16;
+        in_speech_ = true;
+        speech_ms_ += frame_ms;
+        silence_ms_ = 0;
+        return false;
+    }
+
+    in_speech_ = false;
+    noise_energy_ = noise_energy_ == 0 ? energy : (noise_energy_ * 15 + energy) / 16;
+    if (speech_ms_ < ENDPOINT_MIN_SPEECH_MS) {
+        return false;
+    }
+    silence_ms_ += frame_ms;
+    if (silence_ms_ == frame_ms) {
+        // Levels only move at the start of a pause, that is often enough for the threshold
+        UpdateThreshold();
+    }
+    if (silence_ms_ < threshold_ms_) {
+        return false;
+    }
+    endpointed_ = true;
+    ESP_LOGI(TAG, "Endpoint after %d ms of speech, %d ms silence (pause avg %d ms)",
+        speech_ms_, silence_ms_, pause_avg_ms_);
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef ENDPOINT_DETECTOR_H
+#define ENDPOINT_DETECTOR_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include "pcm_frame_pool.h"
+
+// Decides on the device that the user has finished a turn, from the AFE VAD decision of each
+// output frame. The trailing silence allowed before the endpoint starts at the configured value
+// and adapts: it grows with the pauses this speaker leaves inside a turn, and with a poor
+// speech to noise ratio where the VAD releases late and flickers.
+class EndpointDetector {
+public:
+    EndpointDetector() = default;
+
+    void Configure(int sample_rate, int silence_ms, int max_silence_ms);
+    // Starts a new turn, the learned pause length and levels are kept across turns
+    void Reset();
+    // Returns true once, on the frame where the trailing silence passes the threshold
+    bool Process(const PcmFrameRef& frame, bool speech);
+    int threshold_ms() const { return threshold_ms_; }
+    int silence_ms() const { return silence_ms_; }
+
+private:
+    int sample_rate_ = 16000;
+    int base_silence_ms_ = 600;
+    int max_silence_ms_ = 1500;
+    int threshold_ms_ = 600;
+
+    // Per turn
+    int speech_ms_ = 0;
+    int silence_ms_ = 0;
+    bool in_speech_ = false;
+    bool endpointed_ = false;
+
+    // Learned across turns
+    int pause_avg_ms_ = 0;
+    uint64_t noise_energy_ = 0;
+    uint64_t speech_energy_ = 0;
+
+    void UpdateThreshold();
+};
+
+#endif // ENDPOINT_DETECTOR_H
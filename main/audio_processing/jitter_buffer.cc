@@ -0,0 +1,272 @@
+#include "jitter_buffer.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "JitterBuffer"
+
+// Conceal at most this many consecutive frames, longer gaps are skipped
+#define MAX_CONCEALED_FRAMES 3
+// Lower the target delay by one frame after this many frames without late packets or underruns
+#define STABLE_FRAMES_TO_SHRINK 100
+// A frame arriving within this many frame durations of the buffer running dry was late, the stream
+// starved. Later than that it starts a new sentence or stream after a pause in the server.
+#define STARVED_WINDOW_FRAMES 2
+
+JitterBuffer::JitterBuffer(size_t capacity, size_t max_packet_size)
+    : capacity_(capacity), max_packet_size_(max_packet_size) {
+    slot_stride_ = (sizeof(Slot) + max_packet_size_ + 3) & ~size_t(3);
+    size_t slab_size = slot_stride_ * capacity_;
+    slab_ = (uint8_t*)heap_caps_calloc(1, slab_size, MALLOC_CAP_SPIRAM);
+    if (slab_ == nullptr) {
+        slab_ = (uint8_t*)heap_caps_calloc(1, slab_size, MALLOC_CAP_8BIT);
+    }
+    if (slab_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for %u frames", slab_size, capacity_);
+        capacity_ = 0;
+    }
+    target_frames_ = MinFrames();
+    target_delay_ms_ = target_frames_ * frame_duration_ms_;
+}
+
+JitterBuffer::~JitterBuffer() {
+    if (slab_ != nullptr) {
+        heap_caps_free(slab_);
+    }
+}
+
+void JitterBuffer::Configure(int frame_duration_ms, int min_delay_ms, int max_delay_ms) {
+    pending_frame_duration_ms_ = frame_duration_ms;
+    pending_min_delay_ms_ = min_delay_ms;
+    pending_max_delay_ms_ = std::max(min_delay_ms, max_delay_ms);
+    ESP_LOGI(TAG, "Frame duration %d ms, target delay %d-%d ms", frame_duration_ms, min_delay_ms, max_delay_ms);
+    Reset();
+}
+
+void JitterBuffer::Reset() {
+    reset_requested_ = true;
+}
+
+int JitterBuffer::MinFrames() const {
+    return std::max(1, (min_delay_ms_ + frame_duration_ms_ - 1) / frame_duration_ms_);
+}
+
+int JitterBuffer::MaxFrames() const {
+    int frames = (max_delay_ms_ + frame_duration_ms_ - 1) / frame_duration_ms_;
+    return std::clamp(frames, MinFrames(), std::max(1, (int)capacity_ / 2));
+}
+
+void JitterBuffer::Clear() {
+    for (size_t i = 0; i < capacity_; i++) {
+        ((Slot*)(slab_ + i * slot_stride_))->valid = false;
+    }
+    started_ = false;
+    buffering_ = true;
+    buffering_start_us_ = 0;
+    buffered_ = 0;
+    drained_us_ = 0;
+    consecutive_concealed_ = 0;
+    has_last_arrival_ = false;
+}
+
+void JitterBuffer::ApplyPendingReset() {
+    if (reset_requested_.exchange(false)) {
+        frame_duration_ms_ = pending_frame_duration_ms_;
+        min_delay_ms_ = pending_min_delay_ms_;
+        max_delay_ms_ = pending_max_delay_ms_;
+        Clear();
+        clean_frames_ = 0;
+        jitter_us_ = 0;
+        jitter_ms_ = 0;
+        target_frames_ = MinFrames();
+        target_delay_ms_ = target_frames_ * frame_duration_ms_;
+    }
+}
+
+bool JitterBuffer::HasRoom() {
+    ApplyPendingReset();
+    if (!started_) {
+        return capacity_ > 0;
+    }
+    // Leave headroom for reordered packets behind the highest sequence
+    return (int32_t)(highest_sequence_ - next_sequence_) + 1 < (int32_t)capacity_ - 2;
+}
+
+void JitterBuffer::AdjustTarget(int delta) {
+    int target = std::clamp(target_frames_ + delta, MinFrames(), MaxFrames());
+    if (target != target_frames_) {
+        ESP_LOGD(TAG, "Target delay %d -> %d ms", target_frames_ * frame_duration_ms_, target * frame_duration_ms_);
+        target_frames_ = target;
+        target_delay_ms_ = target * frame_duration_ms_;
+    }
+    clean_frames_ = 0;
+}
+
+void JitterBuffer::UpdateArrivalJitter(uint32_t sequence) {
+    int64_t now = esp_timer_get_time();
+    if (has_last_arrival_) {
+        int64_t expected = (int64_t)(int32_t)(sequence - last_arrival_sequence_) * frame_duration_ms_ * 1000;
+        int64_t deviation = (now - last_arrival_us_) - expected;
+        // Bursts sent ahead of real time are harmless, only count packets that arrive later than their spacing
+        if (deviation < 0) {
+            deviation = 0;
+        }
+        jitter_us_ += (deviation - jitter_us_) / 16;
+        jitter_ms_ = jitter_us_ / 1000;
+    }
+    has_last_arrival_ = true;
+    last_arrival_us_ = now;
+    last_arrival_sequence_ = sequence;
+
+    int frame_us = frame_duration_ms_ * 1000;
+    int jitter_frames = (int)((2 * jitter_us_ + frame_us - 1) / frame_us);
+    if (MinFrames() + jitter_frames > target_frames_) {
+        AdjustTarget(MinFrames() + jitter_frames - target_frames_);
+    }
+}
+
+void JitterBuffer::Put(uint32_t sequence, const std::vector<uint8_t>& packet) {
+    ApplyPendingReset();
+    if (capacity_ == 0) {
+        return;
+    }
+    stats_.received++;
+    if (packet.size() > max_packet_size_) {
+        ESP_LOGW(TAG, "Packet too large: %u > %u", packet.size(), max_packet_size_);
+        stats_.overflows++;
+        return;
+    }
+
+    int32_t offset = (int32_t)(sequence - next_sequence_);
+    if (!started_ || offset < -(int32_t)capacity_ * 2 || offset > (int32_t)capacity_ * 2) {
+        // First packet or the sender restarted its sequence, begin a new stream
+        if (started_) {
+            ESP_LOGI(TAG, "Resync stream from %lu to %lu", next_sequence_, sequence);
+        }
+        Clear();
+        started_ = true;
+        next_sequence_ = sequence;
+        highest_sequence_ = sequence;
+        offset = 0;
+    }
+
+    if (offset < 0) {
+        // Arrived after its playout time
+        stats_.late++;
+        AdjustTarget(1);
+        return;
+    }
+    if (offset >= (int32_t)capacity_) {
+        stats_.overflows++;
+        return;
+    }
+
+    auto slot = SlotAt(sequence);
+    if (slot->valid) {
+        if (slot->sequence == sequence) {
+            stats_.duplicate++;
+        } else {
+            stats_.overflows++;
+        }
+        return;
+    }
+    memcpy(slot->data, packet.data(), packet.size());
+    slot->size = packet.size();
+    slot->sequence = sequence;
+    slot->valid = true;
+    buffered_++;
+    if ((int32_t)(sequence - highest_sequence_) > 0) {
+        highest_sequence_ = sequence;
+    }
+
+    if (drained_us_ != 0) {
+        int64_t missed_ms = (esp_timer_get_time() - drained_us_) / 1000;
+        drained_us_ = 0;
+        if (missed_ms <= STARVED_WINDOW_FRAMES * frame_duration_ms_) {
+            // Mid-stream starvation, the frame missed its playout slot
+            stats_.underruns++;
+            AdjustTarget(1);
+        } else {
+            // The end of a sentence, the pause before this one says nothing about the link
+            has_last_arrival_ = false;
+        }
+    }
+    UpdateArrivalJitter(sequence);
+    if (buffering_ && buffering_start_us_ == 0) {
+        buffering_start_us_ = esp_timer_get_time();
+    }
+}
+
+JitterBufferResult JitterBuffer::Get(std::vector<uint8_t>& packet) {
+    ApplyPendingReset();
+    if (!started_) {
+        return kJitterBufferNone;
+    }
+
+    if (buffering_) {
+        if (buffered_ == 0) {
+            return kJitterBufferNone;
+        }
+        // Start once the target delay is buffered, or the stream is too short to ever reach it
+        int64_t waited_ms = (esp_timer_get_time() - buffering_start_us_) / 1000;
+        if (buffered_ < target_frames_ && waited_ms < target_frames_ * frame_duration_ms_) {
+            return kJitterBufferNone;
+        }
+        buffering_ = false;
+        buffering_start_us_ = 0;
+        // Playback begins at the oldest buffered frame
+        while (!SlotAt(next_sequence_)->valid || SlotAt(next_sequence_)->sequence != next_sequence_) {
+            next_sequence_++;
+        }
+    }
+
+    auto slot = SlotAt(next_sequence_);
+    if (slot->valid && slot->sequence == next_sequence_) {
+        packet.assign(slot->data, slot->data + slot->size);
+        slot->valid = false;
+        buffered_--;
+        next_sequence_++;
+        consecutive_concealed_ = 0;
+        stats_.played++;
+        if (++clean_frames_ >= STABLE_FRAMES_TO_SHRINK) {
+            AdjustTarget(-1);
+        }
+        return kJitterBufferPacket;
+    }
+
+    if (buffered_ == 0) {
+        // Nothing newer arrived yet, wait for it instead of concealing the end of a stream.
+        // Only the next arrival tells a starved stream from a finished one, Put decides.
+        buffering_ = true;
+        drained_us_ = esp_timer_get_time();
+        return kJitterBufferNone;
+    }
+
+    // The frame is missing but later ones are here, it is lost
+    stats_.lost++;
+    next_sequence_++;
+    if (consecutive_concealed_ < MAX_CONCEALED_FRAMES) {
+        consecutive_concealed_++;
+        stats_.concealed++;
+        packet.clear();
+        return kJitterBufferConceal;
+    }
+
+    // Long gap, jump to the next frame we have
+    while (!SlotAt(next_sequence_)->valid || SlotAt(next_sequence_)->sequence != next_sequence_) {
+        next_sequence_++;
+        stats_.lost++;
+    }
+    return Get(packet);
+}
+
+JitterBufferStats JitterBuffer::GetStats() const {
+    JitterBufferStats stats = stats_;
+    stats.depth = buffered_;
+    stats.target_delay_ms = target_delay_ms_;
+    stats.jitter_ms = jitter_ms_;
+    return stats;
+}
@@ -0,0 +1,108 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+enum JitterBufferResult {
+    kJitterBufferNone,    // 没有可播放的帧（缓冲中或欠载）
+    kJitterBufferPacket,  // 返回了下一帧
+    kJitterBufferConceal  // 下一帧丢失，需要丢包补偿（PLC）
+};
+
+struct JitterBufferStats {
+    uint32_t received;
+    uint32_t played;
+    uint32_t late;
+    uint32_t duplicate;
+    uint32_t lost;
+    uint32_t concealed;
+    uint32_t underruns;
+    uint32_t overflows;
+    int depth;
+    int target_delay_ms;
+    int jitter_ms;
+};
+
+// Playout buffer keyed on the transport sequence number.
+// Packets are reordered into slot (sequence % capacity), playback starts once the
+// adaptive target delay is buffered, and a missing frame is reported as
+// kJitterBufferConceal so the caller can run opus packet loss concealment.
+// Put / Get must run on the same task, Configure / Reset / depth / GetStats are safe from any task.
+// Configure and Reset only post a request, the owner task applies it at its next Put / Get.
+class JitterBuffer {
+public:
+    JitterBuffer(size_t capacity, size_t max_packet_size);
+    ~JitterBuffer();
+    JitterBuffer(const JitterBuffer&) = delete;
+    JitterBuffer& operator=(const JitterBuffer&) = delete;
+
+    void Configure(int frame_duration_ms, int min_delay_ms, int max_delay_ms);
+    void Reset();
+    bool HasRoom();
+    void Put(uint32_t sequence, const std::vector<uint8_t>& packet);
+    JitterBufferResult Get(std::vector<uint8_t>& packet);
+    int depth() const { return buffered_.load(std::memory_order_relaxed); }
+    JitterBufferStats GetStats() const;
+
+private:
+    struct Slot {
+        uint32_t sequence;
+        uint16_t size;
+        bool valid;
+        uint8_t data[];
+    };
+
+    uint8_t* slab_ = nullptr;
+    size_t slot_stride_ = 0;
+    size_t capacity_;
+    size_t max_packet_size_;
+
+    // Requested from other tasks, applied by the owner task together with the reset
+    std::atomic<bool> reset_requested_{false};
+    std::atomic<int> pending_frame_duration_ms_{60};
+    std::atomic<int> pending_min_delay_ms_{60};
+    std::atomic<int> pending_max_delay_ms_{600};
+
+    // Owner task only
+    int frame_duration_ms_ = 60;
+    int min_delay_ms_ = 60;
+    int max_delay_ms_ = 600;
+
+    bool started_ = false;
+    bool buffering_ = true;
+    int64_t buffering_start_us_ = 0;
+    uint32_t next_sequence_ = 0;
+    uint32_t highest_sequence_ = 0;
+    std::atomic<int> buffered_{0};
+    // When playout ran dry, 0 while frames are buffered
+    int64_t drained_us_ = 0;
+    int consecutive_concealed_ = 0;
+    int clean_frames_ = 0;
+
+    // Arrival jitter estimate (RFC 3550 style, only positive deviations count)
+    bool has_last_arrival_ = false;
+    int64_t last_arrival_us_ = 0;
+    uint32_t last_arrival_sequence_ = 0;
+    int64_t jitter_us_ = 0;
+    int target_frames_ = 1;
+
+    JitterBufferStats stats_ = {};
+    // Published by the owner task for GetStats
+    std::atomic<int> target_delay_ms_{0};
+    std::atomic<int> jitter_ms_{0};
+
+    inline Slot* SlotAt(uint32_t sequence) const {
+        return (Slot*)(slab_ + (sequence % capacity_) * slot_stride_);
+    }
+    void ApplyPendingReset();
+    void Clear();
+    void UpdateArrivalJitter(uint32_t sequence);
+    void AdjustTarget(int delta);
+    int MinFrames() const;
+    int MaxFrames() const;
+};
+
+#endif // JITTER_BUFFER_H
@@ -0,0 +1,136 @@
+#include "opus_packet_queue.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <cstring>
+
+#define TAG "OpusPacketQueue"
+
+OpusPacketQueue::OpusPacketQueue(size_t capacity, size_t max_packet_size, OverflowPolicy policy)
+    : capacity_(capacity), max_packet_size_(max_packet_size), policy_(policy) {
+    // Keep every slot 4-byte aligned so the size header can be accessed directly
+    slot_stride_ = (sizeof(Slot) + max_packet_size_ + 3) & ~size_t(3);
+    size_t slab_size = slot_stride_ * capacity_;
+    slab_ = (uint8_t*)heap_caps_malloc(slab_size, MALLOC_CAP_SPIRAM);
+    if (slab_ == nullptr) {
+        slab_ = (uint8_t*)heap_caps_malloc(slab_size, MALLOC_CAP_8BIT);
+    }
+    if (slab_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for %u packets", slab_size, capacity_);
+        capacity_ = 0;
+        return;
+    }
+    ESP_LOGI(TAG, "Allocated %u packets x %u bytes", capacity_, max_packet_size_);
+}
+
+OpusPacketQueue::~OpusPacketQueue() {
+    if (slab_ != nullptr) {
+        heap_caps_free(slab_);
+    }
+}
+
+bool OpusPacketQueue::Push(uint32_t sequence, const uint8_t* data, size_t size) {
+    if (capacity_ == 0) {
+        dropped_++;
+        return false;
+    }
+    if (size > max_packet_size_) {
+        ESP_LOGW(TAG, "Packet too large: %u > %u", size, max_packet_size_);
+        oversized_++;
+        dropped_++;
+        return false;
+    }
+
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    uint32_t tail = tail_.load(std::memory_order_acquire);
+    if (head - tail >= capacity_) {
+        if (policy_ == kOverflowDropNewest) {
+            dropped_++;
+            return false;
+        }
+        // Evict the oldest packet. If the CAS fails the consumer has just popped it,
+        // so a slot is free either way.
+        if (tail_.compare_exchange_strong(tail, tail + 1, std::memory_order_acq_rel)) {
+            dropped_++;
+        }
+    }
+
+    auto slot = SlotAt(head);
+    memcpy(slot->data, data, size);
+    slot->sequence = sequence;
+    slot->enqueue_time_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    slot->size = size;
+    head_.store(head + 1, std::memory_order_release);
+    pushed_++;
+
+    size_t occupancy = head + 1 - tail_.load(std::memory_order_relaxed);
+    if (occupancy > high_watermark_.load(std::memory_order_relaxed)) {
+        high_watermark_.store(occupancy, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+bool OpusPacketQueue::WaitForRoom(TickType_t timeout) const {
+    TickType_t start = xTaskGetTickCount();
+    while (size() >= capacity_) {
+        if (xTaskGetTickCount() - start >= timeout) {
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    return true;
+}
+
+bool OpusPacketQueue::Pop(std::vector<uint8_t>& packet, uint32_t& sequence) {
+    uint32_t enqueue_time_ms;
+    return Pop(packet, sequence, enqueue_time_ms);
+}
+
+bool OpusPacketQueue::Pop(std::vector<uint8_t>& packet, uint32_t& sequence, uint32_t& enqueue_time_ms) {
+    uint32_t tail = tail_.load(std::memory_order_acquire);
+    while (true) {
+        uint32_t head = head_.load(std::memory_order_acquire);
+        if (tail == head) {
+            return false;
+        }
+        auto slot = SlotAt(tail);
+        size_t size = slot->size;
+        if (size > max_packet_size_) {
+            size = max_packet_size_;
+        }
+        packet.assign(slot->data, slot->data + size);
+        sequence = slot->sequence;
+        enqueue_time_ms = slot->enqueue_time_ms;
+        // If the producer evicted this slot while we were copying, the CAS fails and we retry
+        if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_acq_rel)) {
+            popped_++;
+            return true;
+        }
+    }
+}
+
+void OpusPacketQueue::Clear() {
+    uint32_t tail = tail_.load(std::memory_order_acquire);
+    while (!tail_.compare_exchange_weak(tail, head_.load(std::memory_order_acquire), std::memory_order_acq_rel)) {
+    }
+}
+
+size_t OpusPacketQueue::size() const {
+    uint32_t tail = tail_.load(std::memory_order_acquire);
+    uint32_t head = head_.load(std::memory_order_acquire);
+    return head - tail;
+}
+
+OpusPacketQueueStats OpusPacketQueue::GetStats() const {
+    return OpusPacketQueueStats {
+        .pushed = pushed_.load(std::memory_order_relaxed),
+        .popped = popped_.load(std::memory_order_relaxed),
+        .dropped = dropped_.load(std::memory_order_relaxed),
+        .oversized = oversized_.load(std::memory_order_relaxed),
+        .occupancy = size(),
+        .high_watermark = high_watermark_.load(std::memory_order_relaxed),
+        .capacity = capacity_,
+    };
+}
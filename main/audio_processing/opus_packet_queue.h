@@ -0,0 +1,82 @@
+#ifndef OPUS_PACKET_QUEUE_H
+#define OPUS_PACKET_QUEUE_H
+
+#include <freertos/FreeRTOS.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+enum OverflowPolicy {
+    kOverflowDropNewest, // 队列满时丢弃新到的包
+    kOverflowDropOldest  // 队列满时覆盖最旧的包
+};
+
+struct OpusPacketQueueStats {
+    uint32_t pushed;
+    uint32_t popped;
+    uint32_t dropped;
+    uint32_t oversized;
+    size_t occupancy;
+    size_t high_watermark;
+    size_t capacity;
+};
+
+// Fixed capacity single-producer / single-consumer queue of opus packets.
+// Every slot lives in one slab allocated at construction (PSRAM if present),
+// so Push / Pop never allocate. Push calls must be serialized by the caller,
+// Pop and Clear may run on any task.
+// Each packet carries the transport sequence number (0 means unsequenced, as for local
+// assets and uplink audio) and the esp_timer time in ms it was pushed at.
+class OpusPacketQueue {
+public:
+    OpusPacketQueue(size_t capacity, size_t max_packet_size, OverflowPolicy policy = kOverflowDropOldest);
+    ~OpusPacketQueue();
+    OpusPacketQueue(const OpusPacketQueue&) = delete;
+    OpusPacketQueue& operator=(const OpusPacketQueue&) = delete;
+
+    bool Push(uint32_t sequence, const uint8_t* data, size_t size);
+    // Wait up to `timeout` for a free slot, false if the queue is still full.
+    // Does not reserve the slot, call it outside the lock that serializes Push.
+    bool WaitForRoom(TickType_t timeout) const;
+    bool Pop(std::vector<uint8_t>& packet, uint32_t& sequence);
+    bool Pop(std::vector<uint8_t>& packet, uint32_t& sequence, uint32_t& enqueue_time_ms);
+    void Clear();
+
+    size_t size() const;
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return capacity_; }
+    size_t max_packet_size() const { return max_packet_size_; }
+    OpusPacketQueueStats GetStats() const;
+
+private:
+    struct Slot {
+        uint32_t sequence;
+        uint32_t enqueue_time_ms;
+        uint16_t size;
+        uint8_t data[];
+    };
+
+    uint8_t* slab_ = nullptr;
+    size_t slot_stride_ = 0;
+    size_t capacity_;
+    size_t max_packet_size_;
+    OverflowPolicy policy_;
+
+    // Monotonic indexes, slot = index % capacity_
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+
+    std::atomic<uint32_t> pushed_{0};
+    std::atomic<uint32_t> popped_{0};
+    std::atomic<uint32_t> dropped_{0};
+    std::atomic<uint32_t> oversized_{0};
+    std::atomic<size_t> high_watermark_{0};
+
+    inline Slot* SlotAt(uint32_t index) const {
+        return (Slot*)(slab_ + (index % capacity_) * slot_stride_);
+    }
+};
+
+#endif // OPUS_PACKET_QUEUE_H
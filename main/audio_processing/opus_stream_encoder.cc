@@ -0,0 +1,115 @@
+#include "opus_stream_encoder.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "OpusStreamEncoder"
+
+OpusStreamEncoder::OpusStreamEncoder(int sample_rate, int channels, int duration_ms)
+    : sample_rate_(sample_rate), channels_(channels), duration_ms_(duration_ms) {
+    frame_size_ = sample_rate / 1000 * channels * duration_ms;
+    // Room for the longest frame so SetDuration never allocates
+    in_buffer_.resize(std::max(frame_size_, sample_rate / 1000 * channels * OPUS_STREAM_MAX_DURATION_MS));
+
+    int error;
+    encoder_ = opus_encoder_create(sample_rate, channels, OPUS_APPLICATION_VOIP, &error);
+    if (encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", error);
+        return;
+    }
+
+    // Default DTX enabled, same as OpusEncoderWrapper
+    SetDtx(true);
+    SetComplexity(5);
+}
+
+OpusStreamEncoder::~OpusStreamEncoder() {
+    if (encoder_ != nullptr) {
+        opus_encoder_destroy(encoder_);
+    }
+}
+
+void OpusStreamEncoder::SetComplexity(int complexity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_SET_COMPLEXITY(complexity));
+    }
+    complexity_ = complexity;
+}
+
+void OpusStreamEncoder::EnableGovernor(int min_complexity, int max_complexity, int budget_percent) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    governor_.SetFrameDuration(duration_ms_);
+    governor_.Configure(min_complexity, max_complexity, budget_percent);
+}
+
+void OpusStreamEncoder::SetDtx(bool enable) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_SET_DTX(enable ? 1 : 0));
+    }
+}
+
+void OpusStreamEncoder::SetBitrate(int bitrate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_SET_BITRATE(bitrate));
+    }
+}
+
+void OpusStreamEncoder::SetDuration(int duration_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    duration_ms = std::min(duration_ms, OPUS_STREAM_MAX_DURATION_MS);
+    if (duration_ms == duration_ms_) {
+        return;
+    }
+    duration_ms_ = duration_ms;
+    frame_size_ = sample_rate_ / 1000 * channels_ * duration_ms;
+    in_samples_ = 0;
+    governor_.SetFrameDuration(duration_ms);
+}
+
+void OpusStreamEncoder::ResetState() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ != nullptr) {
+        opus_encoder_ctl(encoder_, OPUS_RESET_STATE);
+    }
+    in_samples_ = 0;
+}
+
+void OpusStreamEncoder::Encode(const int16_t* pcm, size_t samples, const std::function<void(const uint8_t* opus, size_t size)>& handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Audio encoder is not configured");
+        return;
+    }
+
+    while (samples > 0) {
+        size_t count = std::min(samples, (size_t)frame_size_ - in_samples_);
+        memcpy(in_buffer_.data() + in_samples_, pcm, count * sizeof(int16_t));
+        in_samples_ += count;
+        pcm += count;
+        samples -= count;
+        if (in_samples_ < (size_t)frame_size_) {
+            break;
+        }
+
+        in_samples_ = 0;
+        int64_t start_time = esp_timer_get_time();
+        auto ret = opus_encode(encoder_, in_buffer_.data(), frame_size_ / channels_, out_buffer_, sizeof(out_buffer_));
+        int complexity = governor_.AddSample(esp_timer_get_time() - start_time, complexity_);
+        if (complexity >= 0) {
+            opus_encoder_ctl(encoder_, OPUS_SET_COMPLEXITY(complexity));
+            complexity_ = complexity;
+        }
+        if (ret < 0) {
+            ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+            continue;
+        }
+        if (handler != nullptr) {
+            handler(out_buffer_, ret);
+        }
+    }
+}
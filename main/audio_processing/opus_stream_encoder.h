@@ -0,0 +1,56 @@
+#ifndef OPUS_STREAM_ENCODER_H
+#define OPUS_STREAM_ENCODER_H
+
+#include <opus.h>
+
+#include "complexity_governor.h"
+
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+#define OPUS_STREAM_MAX_PACKET_SIZE 1000
+#define OPUS_STREAM_MAX_DURATION_MS 60
+
+// Opus encoder that takes raw pcm pointers and hands out packets from an internal buffer.
+// Unlike OpusEncoderWrapper nothing is allocated per call once constructed.
+class OpusStreamEncoder {
+public:
+    OpusStreamEncoder(int sample_rate, int channels, int duration_ms = 60);
+    ~OpusStreamEncoder();
+    OpusStreamEncoder(const OpusStreamEncoder&) = delete;
+    OpusStreamEncoder& operator=(const OpusStreamEncoder&) = delete;
+
+    inline int sample_rate() const { return sample_rate_; }
+    inline int duration_ms() const { return duration_ms_; }
+    inline int frame_size() const { return frame_size_; }
+
+    void SetComplexity(int complexity);
+    // Let the encoder adjust its own complexity within [min, max] to stay within budget_percent of a frame
+    void EnableGovernor(int min_complexity, int max_complexity, int budget_percent);
+    void SetDtx(bool enable);
+    void SetBitrate(int bitrate);
+    // Drops any partially buffered frame, call it between utterances
+    void SetDuration(int duration_ms);
+    void ResetState();
+    // Buffers the samples and calls handler once for every complete frame.
+    // The packet pointer is only valid during the call.
+    void Encode(const int16_t* pcm, size_t samples, const std::function<void(const uint8_t* opus, size_t size)>& handler);
+    bool IsBufferEmpty() const { return in_samples_ == 0; }
+
+private:
+    std::mutex mutex_;
+    OpusEncoder* encoder_ = nullptr;
+    int sample_rate_;
+    int channels_;
+    int duration_ms_;
+    int frame_size_;
+    int complexity_ = 5;
+    ComplexityGovernor governor_;
+    std::vector<int16_t> in_buffer_;
+    size_t in_samples_ = 0;
+    uint8_t out_buffer_[OPUS_STREAM_MAX_PACKET_SIZE];
+};
+
+#endif // OPUS_STREAM_ENCODER_H
@@ -0,0 +1,122 @@
+#include "pcm_frame_pool.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#define TAG "PcmFramePool"
+
+void PcmFrameRef::reset() {
+    if (frame_ != nullptr) {
+        if (--frame_->refs == 0) {
+            frame_->pool->Release(frame_);
+        }
+        frame_ = nullptr;
+    }
+}
+
+bool PcmFrameRef::resize(size_t samples) {
+    if (frame_ == nullptr || samples > frame_->capacity) {
+        return false;
+    }
+    frame_->samples = samples;
+    return true;
+}
+
+PcmFramePool::~PcmFramePool() {
+    if (slab_ != nullptr) {
+        heap_caps_free(slab_);
+    }
+}
+
+bool PcmFramePool::Initialize(int blocks, size_t block_samples) {
+    if (slab_ != nullptr) {
+        ESP_LOGW(TAG, "Pool already initialized");
+        return block_samples <= block_samples_;
+    }
+    if (blocks > 32) {
+        blocks = 32;
+    }
+
+    size_t slab_size = blocks * block_samples * sizeof(int16_t);
+#if CONFIG_SPIRAM
+    slab_ = (int16_t*)heap_caps_malloc(slab_size, MALLOC_CAP_SPIRAM);
+#endif
+    if (slab_ == nullptr) {
+        slab_ = (int16_t*)heap_caps_malloc(slab_size, MALLOC_CAP_8BIT);
+    }
+    if (slab_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes", slab_size);
+        return false;
+    }
+
+    frames_ = std::make_unique<PcmFrame[]>(blocks);
+    for (int i = 0; i < blocks; i++) {
+        frames_[i].data = slab_ + i * block_samples;
+        frames_[i].capacity = block_samples;
+        frames_[i].pool = this;
+        frames_[i].index = i;
+    }
+    blocks_ = blocks;
+    block_samples_ = block_samples;
+    free_mask_ = blocks == 32 ? UINT32_MAX : (1u << blocks) - 1;
+    ESP_LOGI(TAG, "Initialized %d blocks x %u samples", blocks, block_samples);
+    return true;
+}
+
+PcmFrameRef PcmFramePool::Acquire(size_t samples) {
+    acquired_++;
+    int in_use = ++in_use_;
+    if (in_use > high_watermark_) {
+        high_watermark_ = in_use;
+    }
+
+    if (samples <= block_samples_) {
+        uint32_t mask = free_mask_.load(std::memory_order_acquire);
+        while (mask != 0) {
+            int index = __builtin_ctz(mask);
+            if (free_mask_.compare_exchange_weak(mask, mask & ~(1u << index), std::memory_order_acq_rel)) {
+                auto frame = &frames_[index];
+                frame->samples = samples;
+                frame->refs = 1;
+                return PcmFrameRef(frame);
+            }
+        }
+    }
+
+    // Pool exhausted or the request is larger than a block, fall back to the heap
+    heap_fallbacks_++;
+    auto data = (int16_t*)heap_caps_malloc(samples * sizeof(int16_t), MALLOC_CAP_8BIT);
+    if (data == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u samples", samples);
+        in_use_--;
+        return PcmFrameRef();
+    }
+    auto frame = new PcmFrame();
+    frame->data = data;
+    frame->samples = samples;
+    frame->capacity = samples;
+    frame->pool = this;
+    frame->refs = 1;
+    return PcmFrameRef(frame);
+}
+
+void PcmFramePool::Release(PcmFrame* frame) {
+    in_use_--;
+    if (frame->index < 0) {
+        heap_caps_free(frame->data);
+        delete frame;
+        return;
+    }
+    free_mask_.fetch_or(1u << frame->index, std::memory_order_acq_rel);
+}
+
+PcmFramePoolStats PcmFramePool::GetStats() const {
+    return PcmFramePoolStats {
+        .acquired = acquired_.load(),
+        .heap_fallbacks = heap_fallbacks_.load(),
+        .in_use = in_use_.load(),
+        .high_watermark = high_watermark_.load(),
+        .blocks = blocks_,
+        .block_samples = block_samples_,
+    };
+}
@@ -0,0 +1,104 @@
+#ifndef PCM_FRAME_POOL_H
+#define PCM_FRAME_POOL_H
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+class PcmFramePool;
+
+struct PcmFrame {
+    int16_t* data = nullptr;
+    size_t samples = 0;
+    size_t capacity = 0;
+    std::atomic<int> refs{0};
+    PcmFramePool* pool = nullptr;
+    int index = -1; // -1 if the frame was allocated from the heap because the pool was exhausted
+    int64_t timestamp = 0; // esp_timer time the frame was queued, for latency accounting
+};
+
+// Reference counted handle to a pooled pcm frame, the block returns to the pool with the last reference
+class PcmFrameRef {
+public:
+    PcmFrameRef() = default;
+    explicit PcmFrameRef(PcmFrame* frame) : frame_(frame) {}
+    PcmFrameRef(const PcmFrameRef& other) : frame_(other.frame_) {
+        if (frame_ != nullptr) {
+            frame_->refs++;
+        }
+    }
+    PcmFrameRef(PcmFrameRef&& other) noexcept : frame_(other.frame_) {
+        other.frame_ = nullptr;
+    }
+    PcmFrameRef& operator=(PcmFrameRef other) noexcept {
+        std::swap(frame_, other.frame_);
+        return *this;
+    }
+    ~PcmFrameRef() { reset(); }
+
+    void reset();
+    // Give up ownership without releasing, used to pass frames through FreeRTOS queues
+    PcmFrame* release() {
+        auto frame = frame_;
+        frame_ = nullptr;
+        return frame;
+    }
+    explicit operator bool() const { return frame_ != nullptr; }
+    int16_t* data() const { return frame_->data; }
+    size_t size() const { return frame_ != nullptr ? frame_->samples : 0; }
+    size_t capacity() const { return frame_ != nullptr ? frame_->capacity : 0; }
+    // Shrinks or grows the frame within its block capacity
+    bool resize(size_t samples);
+
+private:
+    PcmFrame* frame_ = nullptr;
+};
+
+struct PcmFramePoolStats {
+    uint32_t acquired;
+    uint32_t heap_fallbacks;
+    int in_use;
+    int high_watermark;
+    int blocks;
+    size_t block_samples;
+};
+
+// Fixed-size pcm blocks carved from one slab, shared by the capture path
+// (ReadAudio -> AFE -> encoder) so frames can be handed between tasks without allocating.
+class PcmFramePool {
+public:
+    static PcmFramePool& GetInstance() {
+        static PcmFramePool instance;
+        return instance;
+    }
+    PcmFramePool(const PcmFramePool&) = delete;
+    PcmFramePool& operator=(const PcmFramePool&) = delete;
+
+    // blocks must not exceed 32
+    bool Initialize(int blocks, size_t block_samples);
+    // Returns an empty ref if the pool is exhausted and the heap is too
+    PcmFrameRef Acquire(size_t samples);
+    PcmFramePoolStats GetStats() const;
+
+private:
+    PcmFramePool() = default;
+    ~PcmFramePool();
+
+    friend class PcmFrameRef;
+    void Release(PcmFrame* frame);
+
+    int16_t* slab_ = nullptr;
+    std::unique_ptr<PcmFrame[]> frames_;
+    int blocks_ = 0;
+    size_t block_samples_ = 0;
+    std::atomic<uint32_t> free_mask_{0};
+
+    std::atomic<uint32_t> acquired_{0};
+    std::atomic<uint32_t> heap_fallbacks_{0};
+    std::atomic<int> in_use_{0};
+    std::atomic<int> high_watermark_{0};
+};
+
+#endif // PCM_FRAME_POOL_H
@@ -0,0 +1,89 @@
+#include "pcm_ring_buffer.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "PcmRingBuffer"
+
+PcmRingBuffer::~PcmRingBuffer() {
+    if (buffer_ != nullptr) {
+        heap_caps_free(buffer_);
+    }
+}
+
+bool PcmRingBuffer::Allocate(size_t capacity) {
+    // Power of two so the wrapping sample indexes stay continuous modulo capacity
+    size_t rounded = 1;
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+    capacity = rounded;
+
+    if (buffer_ != nullptr) {
+        if (capacity == capacity_) {
+            Flush();
+            return true;
+        }
+        heap_caps_free(buffer_);
+        buffer_ = nullptr;
+        capacity_ = 0;
+    }
+    buffer_ = (int16_t*)heap_caps_malloc(capacity * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (buffer_ == nullptr) {
+        buffer_ = (int16_t*)heap_caps_malloc(capacity * sizeof(int16_t), MALLOC_CAP_8BIT);
+    }
+    if (buffer_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u samples", capacity);
+        return false;
+    }
+    capacity_ = capacity;
+    read_index_ = write_index_.load();
+    return true;
+}
+
+size_t PcmRingBuffer::available() const {
+    return write_index_.load(std::memory_order_acquire) - read_index_.load(std::memory_order_acquire);
+}
+
+size_t PcmRingBuffer::Write(const int16_t* data, size_t samples) {
+    uint32_t write_index = write_index_.load(std::memory_order_relaxed);
+    uint32_t read_index = read_index_.load(std::memory_order_acquire);
+    samples = std::min(samples, capacity_ - (write_index - read_index));
+    if (samples == 0) {
+        return 0;
+    }
+
+    size_t offset = write_index % capacity_;
+    size_t first = std::min(samples, capacity_ - offset);
+    memcpy(buffer_ + offset, data, first * sizeof(int16_t));
+    memcpy(buffer_, data + first, (samples - first) * sizeof(int16_t));
+    write_index_.store(write_index + samples, std::memory_order_release);
+    return samples;
+}
+
+size_t PcmRingBuffer::Read(int16_t* dest, size_t samples) {
+    uint32_t read_index = read_index_.load(std::memory_order_acquire);
+    uint32_t write_index = write_index_.load(std::memory_order_acquire);
+    samples = std::min(samples, (size_t)(write_index - read_index));
+    if (samples == 0) {
+        return 0;
+    }
+
+    size_t offset = read_index % capacity_;
+    size_t first = std::min(samples, capacity_ - offset);
+    memcpy(dest, buffer_ + offset, first * sizeof(int16_t));
+    memcpy(dest + first, buffer_, (samples - first) * sizeof(int16_t));
+    // A concurrent Flush wins, the samples we copied are discarded
+    if (!read_index_.compare_exchange_strong(read_index, read_index + samples, std::memory_order_acq_rel)) {
+        return 0;
+    }
+    return samples;
+}
+
+void PcmRingBuffer::Flush() {
+    uint32_t read_index = read_index_.load(std::memory_order_acquire);
+    while (!read_index_.compare_exchange_weak(read_index, write_index_.load(std::memory_order_acquire), std::memory_order_acq_rel)) {
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef PCM_RING_BUFFER_H
+#define PCM_RING_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// Single-producer / single-consumer ring of 16-bit PCM samples.
+// Flush may be called from any task and drops everything buffered in O(1).
+class PcmRingBuffer {
+public:
+    PcmRingBuffer() = default;
+    ~PcmRingBuffer();
+    PcmRingBuffer(const PcmRingBuffer&) = delete;
+    PcmRingBuffer& operator=(const PcmRingBuffer&) = delete;
+
+    bool Allocate(size_t capacity);
+    size_t Write(const int16_t* data, size_t samples);
+    size_t Read(int16_t* dest, size_t samples);
+    void Flush();
+
+    size_t available() const;
+    size_t space() const { return capacity_ - available(); }
+    size_t capacity() const { return capacity_; }
+
+private:
+    int16_t* buffer_ = nullptr;
+    size_t capacity_ = 0;
+    // Monotonic sample indexes
+    std::atomic<uint32_t> write_index_{0};
+    std::atomic<uint32_t> read_index_{0};
+};
+
+#endif // PCM_RING_BUFFER_H
@@ -0,0 +1,73 @@
+#include "uplink_controller.h"
+
+#include <esp_log.h>
+
+#define TAG "UplinkController"
+
+// Consecutive windows needed before stepping down / up
+#define SAMPLES_TO_DEGRADE 2
+#define SAMPLES_TO_RECOVER 10
+
+// Indexed by LinkQuality
+static const UplinkProfile kProfiles[] = {
+    { .frame_duration_ms = 20, .bitrate = 24000 },
+    { .frame_duration_ms = 40, .bitrate = 16000 },
+    { .frame_duration_ms = 60, .bitrate = 12000 },
+};
+
+static const char* const kQualityNames[] = { "good", "fair", "poor" };
+
+void UplinkController::Reset(bool cellular) {
+    cellular_ = cellular;
+    quality_ = cellular ? kLinkQualityPoor : kLinkQualityFair;
+    worse_samples_ = 0;
+    better_samples_ = 0;
+}
+
+UplinkProfile UplinkController::profile() const {
+    return kProfiles[quality_];
+}
+
+LinkQuality UplinkController::Classify(const LinkSample& sample) const {
+    int loss_percent = sample.packets_expected > 0 ? sample.packets_lost * 100 / sample.packets_expected : 0;
+    size_t queue_percent = sample.send_queue_capacity > 0 ? sample.send_queue_depth * 100 / sample.send_queue_capacity : 0;
+
+    if (sample.send_drops > 0 || queue_percent >= 50 || loss_percent >= 5 || sample.send_latency_us >= 20000 ||
+        (sample.signal_quality >= 0 && sample.signal_quality < 30)) {
+        return kLinkQualityPoor;
+    }
+    if (queue_percent >= 25 || loss_percent >= 1 || sample.send_latency_us >= 5000 ||
+        (sample.signal_quality >= 0 && sample.signal_quality < 60) || cellular_) {
+        return kLinkQualityFair;
+    }
+    return kLinkQualityGood;
+}
+
+bool UplinkController::Update(const LinkSample& sample) {
+    auto observed = Classify(sample);
+    auto previous = quality_;
+
+    if (observed > quality_) {
+        better_samples_ = 0;
+        if (++worse_samples_ >= SAMPLES_TO_DEGRADE) {
+            quality_ = observed;
+            worse_samples_ = 0;
+        }
+    } else if (observed < quality_) {
+        worse_samples_ = 0;
+        if (++better_samples_ >= SAMPLES_TO_RECOVER) {
+            quality_ = (LinkQuality)(quality_ - 1);
+            better_samples_ = 0;
+        }
+    } else {
+        worse_samples_ = 0;
+        better_samples_ = 0;
+    }
+
+    if (quality_ == previous) {
+        return false;
+    }
+    ESP_LOGI(TAG, "Link %s -> %s: %d ms frames at %d bps", kQualityNames[previous], kQualityNames[quality_],
+        profile().frame_duration_ms, profile().bitrate);
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef UPLINK_CONTROLLER_H
+#define UPLINK_CONTROLLER_H
+
+#include <cstdint>
+#include <cstddef>
+
+enum LinkQuality {
+    kLinkQualityGood,
+    kLinkQualityFair,
+    kLinkQualityPoor
+};
+
+// One observation window of the link
+struct LinkSample {
+    size_t send_queue_depth;
+    size_t send_queue_capacity;
+    uint32_t send_drops;      // packets dropped by the uplink queues in this window
+    uint32_t packets_expected; // downlink packets expected in this window (0 if nothing was received)
+    uint32_t packets_lost;
+    uint32_t send_latency_us; // average time spent in SendAudio
+    int signal_quality;       // 0-100, -1 if unknown
+};
+
+struct UplinkProfile {
+    int frame_duration_ms;
+    int bitrate;
+};
+
+// Picks the uplink opus frame duration and bitrate from measured link conditions.
+// Degrades quickly when the link gets worse and recovers one step at a time.
+class UplinkController {
+public:
+    // Cellular links never use the shortest frames, the per-packet overhead costs more than it saves
+    void Reset(bool cellular);
+    // Returns true if the profile changed
+    bool Update(const LinkSample& sample);
+
+    inline LinkQuality quality() const { return quality_; }
+    UplinkProfile profile() const;
+
+private:
+    bool cellular_ = false;
+    LinkQuality quality_ = kLinkQualityFair;
+    int worse_samples_ = 0;
+    int better_samples_ = 0;
+
+    LinkQuality Classify(const LinkSample& sample) const;
+};
+
+#endif // UPLINK_CONTROLLER_H
@@ -0,0 +1,133 @@
+#include "vad_gate.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "VadGate"
+
+// Mean square energy a frame must exceed regardless of the noise floor (about -50 dBFS)
+#define VAD_GATE_MIN_ENERGY 10000
+// Speech when the energy is this many times the noise floor (~6 dB)
+#define VAD_GATE_SPEECH_RATIO 4
+// Speech pauses for breath well within this, so its quietest frame is background noise
+#define VAD_GATE_FLOOR_WINDOW_MS 3000
+
+void VadGate::Configure(int sample_rate, int hangover_ms, int keepalive_ms) {
+    sample_rate_ = sample_rate;
+    hangover_ms_ = hangover_ms;
+    keepalive_ms_ = keepalive_ms;
+    Reset();
+}
+
+void VadGate::Reset() {
+    speaking_ = false;
+    hangover_left_ms_ = 0;
+    silent_ms_ = 0;
+    noise_floor_ = 0;
+    window_min_energy_ = UINT64_MAX;
+    window_ms_ = 0;
+    ClearPreroll();
+}
+
+void VadGate::ClearPreroll() {
+    for (auto& frame : preroll_) {
+        frame.reset();
+    }
+    preroll_start_ = 0;
+    preroll_count_ = 0;
+}
+
+bool VadGate::IsSpeech(const PcmFrameRef& frame, int frame_ms) {
+    const int16_t* data = frame.data();
+    size_t samples = frame.size();
+    if (samples == 0) {
+        return false;
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < samples; i++) {
+        sum += (int32_t)data[i] * data[i];
+    }
+    uint64_t energy = sum / samples;
+
+    // Follow drops in the floor quickly and rises slowly, speech level frames do not move it up
+    if (noise_floor_ == 0 || energy < noise_floor_) {
+        noise_floor_ = noise_floor_ == 0 ? energy : (noise_floor_ + energy) / 2;
+    } else if (energy < noise_floor_ * VAD_GATE_SPEECH_RATIO) {
+        noise_floor_ += (energy - noise_floor_) / 64;
+    }
+    // A fan turning on lifts every frame past the ratio above, the window minimum still
+    // follows it: move halfway up to it once per window
+    window_min_energy_ = std::min(window_min_energy_, energy);
+    window_ms_ += frame_ms;
+    if (window_ms_ >= VAD_GATE_FLOOR_WINDOW_MS) {
+        if (window_min_energy_ > noise_floor_) {
+            noise_floor_ = (noise_floor_ + window_min_energy_) / 2;
+        }
+        window_min_energy_ = UINT64_MAX;
+        window_ms_ = 0;
+    }
+    return energy > VAD_GATE_MIN_ENERGY && energy > noise_floor_ * VAD_GATE_SPEECH_RATIO;
+}
+
+void VadGate::Process(PcmFrameRef&& frame, const std::function<void(PcmFrameRef&& frame)>& output) {
+    int frame_ms = frame.size() * 1000 / sample_rate_;
+    frames_++;
+
+    if (IsSpeech(frame, frame_ms)) {
+        if (!speaking_) {
+            speaking_ = true;
+            ESP_LOGD(TAG, "Speech start, replay %d frames", preroll_count_);
+            for (int i = 0; i < preroll_count_; i++) {
+                auto& held = preroll_[(preroll_start_ + i) % VAD_GATE_PREROLL_FRAMES];
+                output(std::move(held));
+                // Counted as suppressed when it was held back, it is sent after all
+                suppressed_--;
+            }
+            preroll_start_ = 0;
+            preroll_count_ = 0;
+        }
+        hangover_left_ms_ = hangover_ms_;
+        silent_ms_ = 0;
+        output(std::move(frame));
+        return;
+    }
+
+    if (speaking_) {
+        hangover_left_ms_ -= frame_ms;
+        if (hangover_left_ms_ > 0) {
+            output(std::move(frame));
+            return;
+        }
+        speaking_ = false;
+        ESP_LOGD(TAG, "Speech end");
+    }
+
+    silent_ms_ += frame_ms;
+    if (keepalive_ms_ > 0 && silent_ms_ >= keepalive_ms_) {
+        silent_ms_ = 0;
+        // The held frames are older than the keepalive, replaying them at the next onset
+        // would put them behind it
+        ClearPreroll();
+        output(std::move(frame));
+        return;
+    }
+
+    // Hold the frame for pre-roll, the oldest one falls out
+    suppressed_++;
+    if (preroll_count_ == VAD_GATE_PREROLL_FRAMES) {
+        preroll_[preroll_start_] = std::move(frame);
+        preroll_start_ = (preroll_start_ + 1) % VAD_GATE_PREROLL_FRAMES;
+    } else {
+        preroll_[(preroll_start_ + preroll_count_) % VAD_GATE_PREROLL_FRAMES] = std::move(frame);
+        preroll_count_++;
+    }
+}
+
+VadGateStats VadGate::GetStats() const {
+    return VadGateStats {
+        .frames = frames_,
+        .suppressed = suppressed_,
+        .suppressed_percent = frames_ > 0 ? (int)((uint64_t)suppressed_ * 100 / frames_) : 0,
+        .speaking = speaking_,
+    };
+}
@@ -0,0 +1,62 @@
+#ifndef VAD_GATE_H
+#define VAD_GATE_H
+
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#include "pcm_frame_pool.h"
+
+// Frames of silence kept to replay ahead of a speech onset (~190ms of 32ms AFE chunks)
+#define VAD_GATE_PREROLL_FRAMES 6
+
+struct VadGateStats {
+    uint32_t frames;
+    uint32_t suppressed;
+    int suppressed_percent;
+    bool speaking;
+};
+
+// Energy gate for the uplink when the AFE VAD is off (realtime mode).
+// Tracks the noise floor, passes speech plus a hangover, holds back silence and
+// replays the last few silent frames when speech starts so onsets are not clipped.
+// While suppressed one keepalive frame is let through every keepalive_ms, opus DTX
+// turns it into a comfort noise update.
+class VadGate {
+public:
+    VadGate() = default;
+    VadGate(const VadGate&) = delete;
+    VadGate& operator=(const VadGate&) = delete;
+
+    void Configure(int sample_rate, int hangover_ms, int keepalive_ms);
+    // Drops the pre-roll and restarts noise floor tracking, call before a new session
+    void Reset();
+    // Calls output for every frame that should be encoded, in order
+    void Process(PcmFrameRef&& frame, const std::function<void(PcmFrameRef&& frame)>& output);
+    VadGateStats GetStats() const;
+
+private:
+    int sample_rate_ = 16000;
+    int hangover_ms_ = 300;
+    int keepalive_ms_ = 1000;
+
+    bool speaking_ = false;
+    int hangover_left_ms_ = 0;
+    int silent_ms_ = 0;
+    uint64_t noise_floor_ = 0;
+    // Quietest frame of the current window, lifts the floor after a lasting rise in ambient noise
+    uint64_t window_min_energy_ = UINT64_MAX;
+    int window_ms_ = 0;
+
+    PcmFrameRef preroll_[VAD_GATE_PREROLL_FRAMES];
+    int preroll_start_ = 0;
+    int preroll_count_ = 0;
+
+    uint32_t frames_ = 0;
+    uint32_t suppressed_ = 0;
+
+    bool IsSpeech(const PcmFrameRef& frame, int frame_ms);
+    void ClearPreroll();
+};
+
+#endif // VAD_GATE_H
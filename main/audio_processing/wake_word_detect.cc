@@ -2,27 +2,24 @@
 #include "application.h"
 
 #include <esp_log.h>
-#include <model_path.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
 #include <arpa/inet.h>
 #include <sstream>
 
 #define DETECTION_RUNNING_EVENT 1
+#define WAKE_WORD_SEALED_EVENT 2
+#define WAKE_WORD_ENCODED_EVENT 4
 
 static const char* TAG = "WakeWordDetect";
 
 WakeWordDetect::WakeWordDetect()
-    : afe_data_(nullptr),
-      wake_word_pcm_(),
-      wake_word_opus_() {
+    : wake_word_opus_(WAKE_WORD_PREROLL_MS / OPUS_FRAME_DURATION_MS + 1, OPUS_STREAM_MAX_PACKET_SIZE, kOverflowDropOldest) {
 
     event_group_ = xEventGroupCreate();
 }
 
 WakeWordDetect::~WakeWordDetect() {
-    if (afe_data_ != nullptr) {
-        afe_iface_->destroy(afe_data_);
-    }
-
     if (wake_word_encode_task_stack_ != nullptr) {
         heap_caps_free(wake_word_encode_task_stack_);
     }
@@ -30,13 +27,11 @@ WakeWordDetect::~WakeWordDetect() {
     vEventGroupDelete(event_group_);
 }
 
-void WakeWordDetect::Initialize(AudioCodec* codec) {
-    codec_ = codec;
-    int ref_num = codec_->input_reference() ? 1 : 0;
+void WakeWordDetect::Initialize(AudioFrontEnd* front_end) {
+    front_end_ = front_end;
 
-    srmodel_list_t *models = esp_srmodel_init("model");
+    auto models = front_end_->models();
     for (int i = 0; i < models->num; i++) {
-        ESP_LOGI(TAG, "Model %d: %s", i, models->model_name[i]);
         if (strstr(models->model_name[i], ESP_WN_PREFIX) != NULL) {
             wakenet_model_ = models->model_name[i];
             auto words = esp_srmodel_get_wake_words(models, wakenet_model_);
@@ -49,133 +44,150 @@ void WakeWordDetect::Initialize(AudioCodec* codec) {
         }
     }
 
-    std::string input_format;
-    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
-        input_format.push_back('M');
-    }
-    for (int i = 0; i < ref_num; i++) {
-        input_format.push_back('R');
-    }
-    afe_config_t* afe_config = afe_config_init(input_format.c_str(), models, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
-    afe_config->aec_init = codec_->input_reference();
-    afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
-    afe_config->afe_perferred_core = 1;
-    afe_config->afe_perferred_priority = 1;
-    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
-    
-    afe_iface_ = esp_afe_handle_from_config(afe_config);
-    afe_data_ = afe_iface_->create_from_config(afe_config);
-
-    xTaskCreate([](void* arg) {
+    wake_word_pcm_.Allocate(16000 * WAKE_WORD_PCM_RING_MS / 1000);
+    wake_word_encoder_ = std::make_unique<OpusStreamEncoder>(16000, 1, OPUS_FRAME_DURATION_MS);
+    wake_word_encoder_->SetComplexity(0); // 0 is the fastest
+    wake_word_encoder_->SetDtx(false); // keep the pre-roll continuous for the server
+
+    // Opus needs a large stack, keep it in PSRAM
+    wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_SPIRAM);
+    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
         auto this_ = (WakeWordDetect*)arg;
-        this_->AudioDetectionTask();
+        this_->WakeWordEncodeTask();
         vTaskDelete(NULL);
-    }, "audio_detection", 4096, this, 3, nullptr);
+    }, "wake_word_encode", 4096 * 8, this, 2, wake_word_encode_task_stack_, &wake_word_encode_task_buffer_);
+
+    front_end_->AddConsumer([this](const afe_fetch_result_t* res) {
+        OnFetchResult(res);
+    });
 }
 
 void WakeWordDetect::OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback) {
     wake_word_detected_callback_ = callback;
 }
 
+void WakeWordDetect::OnVoiceOnset(std::function<void()> callback) {
+    voice_onset_callback_ = callback;
+}
+
 void WakeWordDetect::StartDetection() {
+    // Start a fresh pre-roll if the previous one was sealed by a detection
+    if (xEventGroupGetBits(event_group_) & WAKE_WORD_SEALED_EVENT) {
+        wake_word_pcm_.Flush();
+        wake_word_opus_.Clear();
+        wake_word_encoder_->ResetState();
+        xEventGroupClearBits(event_group_, WAKE_WORD_SEALED_EVENT | WAKE_WORD_ENCODED_EVENT);
+    }
+    front_end_->EnableWakeNet(true);
     xEventGroupSetBits(event_group_, DETECTION_RUNNING_EVENT);
 }
 
 void WakeWordDetect::StopDetection() {
+    // Only WakeNet is switched off, the shared AFE keeps its buffers
     xEventGroupClearBits(event_group_, DETECTION_RUNNING_EVENT);
-    if (afe_data_ != nullptr) {
-        afe_iface_->reset_buffer(afe_data_);
-    }
+    front_end_->EnableWakeNet(false);
 }
 
 bool WakeWordDetect::IsDetectionRunning() {
     return xEventGroupGetBits(event_group_) & DETECTION_RUNNING_EVENT;
 }
 
-void WakeWordDetect::Feed(const std::vector<int16_t>& data) {
-    afe_iface_->feed(afe_data_, data.data());
-}
-
-size_t WakeWordDetect::GetFeedSize() {
-    return afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
-}
-
-void WakeWordDetect::AudioDetectionTask() {
-    auto fetch_size = afe_iface_->get_fetch_chunksize(afe_data_);
-    auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
-    ESP_LOGI(TAG, "Audio detection task started, feed size: %d fetch size: %d",
-        feed_size, fetch_size);
-
-    while (true) {
-        xEventGroupWaitBits(event_group_, DETECTION_RUNNING_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
-
-        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
-        if (res == nullptr || res->ret_value == ESP_FAIL) {
-            continue;;
-        }
+void WakeWordDetect::OnFetchResult(const afe_fetch_result_t* res) {
+    if (!IsDetectionRunning()) {
+        return;
+    }
 
-        // Store the wake word data for voice recognition, like who is speaking
-        StoreWakeWordData((uint16_t*)res->data, res->data_size / sizeof(uint16_t));
+    // Store the wake word data for voice recognition, like who is speaking
+    StoreWakeWordData((const int16_t*)res->data, res->data_size / sizeof(int16_t));
+    DetectVoiceOnset((const int16_t*)res->data, res->data_size / sizeof(int16_t));
 
-        if (res->wakeup_state == WAKENET_DETECTED) {
-            StopDetection();
-            last_detected_wake_word_ = wake_words_[res->wake_word_index - 1];
+    if (res->wakeup_state == WAKENET_DETECTED) {
+        StopDetection();
+        last_detected_wake_word_ = wake_words_[res->wake_word_index - 1];
+        last_wake_word_samples_ = res->wake_word_length;
 
-            if (wake_word_detected_callback_) {
-                wake_word_detected_callback_(last_detected_wake_word_);
-            }
+        if (wake_word_detected_callback_) {
+            wake_word_detected_callback_(last_detected_wake_word_);
         }
     }
 }
 
-void WakeWordDetect::StoreWakeWordData(uint16_t* data, size_t samples) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.emplace_back(std::vector<int16_t>(data, data + samples));
-    // keep about 2 seconds of data, detect duration is 32ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 32) {
-        wake_word_pcm_.pop_front();
+void WakeWordDetect::DetectVoiceOnset(const int16_t* data, size_t samples) {
+    if (!voice_onset_callback_ || samples == 0) {
+        return;
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < samples; i++) {
+        sum += (int32_t)data[i] * data[i];
+    }
+    uint64_t energy = sum / samples;
+    if (noise_energy_ == 0 || energy < noise_energy_ * WAKE_WORD_ONSET_RATIO) {
+        // Only quiet frames move the floor, so a long phrase does not raise it
+        noise_energy_ = noise_energy_ == 0 ? energy : (noise_energy_ * 31 + energy) / 32;
+        onset_frames_ = 0;
+        return;
+    }
+    if (++onset_frames_ != WAKE_WORD_ONSET_FRAMES) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (now - last_onset_time_ >= WAKE_WORD_ONSET_HOLDOFF_MS * 1000LL) {
+        last_onset_time_ = now;
+        voice_onset_callback_();
     }
 }
 
-void WakeWordDetect::EncodeWakeWordData() {
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(4096 * 8, MALLOC_CAP_SPIRAM);
+void WakeWordDetect::StoreWakeWordData(const int16_t* data, size_t samples) {
+    if (wake_word_pcm_.Write(data, samples) < samples) {
+        ESP_LOGW(TAG, "Wake word encoder is behind, dropping pre-roll audio");
     }
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (WakeWordDetect*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            auto encoder = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
-            encoder->SetComplexity(0); // 0 is the fastest
-
-            for (auto& pcm: this_->wake_word_pcm_) {
-                encoder->Encode(std::move(pcm), [this_](std::vector<uint8_t>&& opus) {
-                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                    this_->wake_word_opus_.emplace_back(std::move(opus));
-                    this_->wake_word_cv_.notify_all();
-                });
-            }
-            this_->wake_word_pcm_.clear();
+    xTaskNotifyGive(wake_word_encode_task_);
+}
 
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %zu packets in %lld ms",
-                this_->wake_word_opus_.size(), (end_time - start_time) / 1000);
+void WakeWordDetect::WakeWordEncodeTask() {
+    // Packets older than the pre-roll window fall out of the queue on their own
+    std::vector<int16_t> pcm(wake_word_encoder_->frame_size());
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        size_t samples;
+        while ((samples = wake_word_pcm_.Read(pcm.data(), pcm.size())) > 0) {
+            wake_word_encoder_->Encode(pcm.data(), samples, [this](const uint8_t* opus, size_t size) {
+                wake_word_opus_.Push(0, opus, size);
+            });
+        }
+        // Detection stopped before sealing, so the ring is drained for good
+        if (xEventGroupGetBits(event_group_) & WAKE_WORD_SEALED_EVENT) {
+            xEventGroupSetBits(event_group_, WAKE_WORD_ENCODED_EVENT);
+        }
+    }
+}
 
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
+void WakeWordDetect::EncodeWakeWordData() {
+    auto start_time = esp_timer_get_time();
+    xEventGroupSetBits(event_group_, WAKE_WORD_SEALED_EVENT);
+    xTaskNotifyGive(wake_word_encode_task_);
+    xEventGroupWaitBits(event_group_, WAKE_WORD_ENCODED_EVENT, pdFALSE, pdTRUE, pdMS_TO_TICKS(1000));
+
+    // Keep the wake word plus a margin before its onset, one extra packet covers the unflushed tail.
+    // esp-sr reports the word length in samples, 0 if the model does not provide it.
+    last_trimmed_bytes_ = 0;
+    size_t dropped = 0;
+    if (last_wake_word_samples_ > 0) {
+        int keep_ms = last_wake_word_samples_ * 1000 / 16000 + CONFIG_WAKE_WORD_PREROLL_MARGIN_MS;
+        size_t keep_packets = (keep_ms + OPUS_FRAME_DURATION_MS - 1) / OPUS_FRAME_DURATION_MS + 1;
+        std::vector<uint8_t> opus;
+        uint32_t sequence;
+        while (wake_word_opus_.size() > keep_packets && wake_word_opus_.Pop(opus, sequence)) {
+            last_trimmed_bytes_ += opus.size();
+            dropped++;
         }
-        vTaskDelete(NULL);
-    }, "encode_detect_packets", 4096 * 8, this, 2, wake_word_encode_task_stack_, &wake_word_encode_task_buffer_);
+        total_trimmed_bytes_ += last_trimmed_bytes_;
+    }
+    ESP_LOGI(TAG, "Wake word pre-roll ready in %lld ms: %u packets, trimmed %u packets / %lu bytes before the onset",
+        (esp_timer_get_time() - start_time) / 1000, wake_word_opus_.size(), dropped, last_trimmed_bytes_);
 }
 
 bool WakeWordDetect::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    std::unique_lock<std::mutex> lock(wake_word_mutex_);
-    wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
-    });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+    uint32_t sequence;
+    return wake_word_opus_.Pop(opus, sequence);
 }
@@ -5,54 +5,74 @@
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
 
-#include <esp_afe_sr_models.h>
-#include <esp_nsn_models.h>
-
-#include <list>
 #include <string>
 #include <vector>
+#include <memory>
 #include <functional>
-#include <mutex>
-#include <condition_variable>
 
-#include "audio_codec.h"
+#include "audio_front_end.h"
+#include "pcm_ring_buffer.h"
+#include "opus_packet_queue.h"
+#include "opus_stream_encoder.h"
+
+// Pre-roll sent ahead of the wake word, and the pcm handed from detection to the encoder
+#define WAKE_WORD_PREROLL_MS 2000
+#define WAKE_WORD_PCM_RING_MS 500
+
+// Voice onset while waiting for the wake word: frames this many times above the noise floor
+// (~6 dB) in a row, reported at most once per holdoff
+#define WAKE_WORD_ONSET_RATIO 4
+#define WAKE_WORD_ONSET_FRAMES 3
+#define WAKE_WORD_ONSET_HOLDOFF_MS 5000
 
 class WakeWordDetect {
 public:
     WakeWordDetect();
     ~WakeWordDetect();
 
-    void Initialize(AudioCodec* codec);
-    void Feed(const std::vector<int16_t>& data);
+    void Initialize(AudioFrontEnd* front_end);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
+    // Someone started talking, maybe the wake phrase. Called from the AFE task, keep it short.
+    void OnVoiceOnset(std::function<void()> callback);
     void StartDetection();
     void StopDetection();
     bool IsDetectionRunning();
-    size_t GetFeedSize();
+    // Seal the pre-roll after a detection, the encoder flushes what is still queued
     void EncodeWakeWordData();
+    // Returns false once the whole pre-roll has been handed out
     bool GetWakeWordOpus(std::vector<uint8_t>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
+    // Pre-roll bytes dropped by trimming to the wake word onset, last detection and since boot
+    uint32_t last_trimmed_bytes() const { return last_trimmed_bytes_; }
+    uint32_t total_trimmed_bytes() const { return total_trimmed_bytes_; }
 
 private:
-    esp_afe_sr_iface_t* afe_iface_ = nullptr;
-    esp_afe_sr_data_t* afe_data_ = nullptr;
+    AudioFrontEnd* front_end_ = nullptr;
     char* wakenet_model_ = NULL;
     std::vector<std::string> wake_words_;
     EventGroupHandle_t event_group_;
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
-    AudioCodec* codec_ = nullptr;
+    std::function<void()> voice_onset_callback_;
+    uint64_t noise_energy_ = 0;
+    int onset_frames_ = 0;
+    int64_t last_onset_time_ = 0;
     std::string last_detected_wake_word_;
+    int last_wake_word_samples_ = 0;
+    uint32_t last_trimmed_bytes_ = 0;
+    uint32_t total_trimmed_bytes_ = 0;
 
+    // The pre-roll is encoded continuously in the background so the packets are ready on detection
     TaskHandle_t wake_word_encode_task_ = nullptr;
     StaticTask_t wake_word_encode_task_buffer_;
     StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::list<std::vector<int16_t>> wake_word_pcm_;
-    std::list<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    PcmRingBuffer wake_word_pcm_;
+    OpusPacketQueue wake_word_opus_;
+    std::unique_ptr<OpusStreamEncoder> wake_word_encoder_;
 
-    void StoreWakeWordData(uint16_t* data, size_t size);
-    void AudioDetectionTask();
+    void StoreWakeWordData(const int16_t* data, size_t samples);
+    void DetectVoiceOnset(const int16_t* data, size_t samples);
+    void OnFetchResult(const afe_fetch_result_t* res);
+    void WakeWordEncodeTask();
 };
 
 #endif
@@ -43,8 +43,12 @@ public:
     virtual WebSocket* CreateWebSocket() = 0;
     virtual Mqtt* CreateMqtt() = 0;
     virtual Udp* CreateUdp() = 0;
+    // Starts a TCP connection in the background for the next TLS connect to host:port, if supported
+    virtual void Preconnect(const std::string& host, int port) {}
     virtual void StartNetwork() = 0;
     virtual const char* GetNetworkStateIcon() = 0;
+    // Link signal quality 0-100, -1 if unknown
+    virtual int GetSignalQuality() { return -1; }
     virtual bool GetBatteryLevel(int &level, bool& charging, bool& discharging);
     virtual std::string GetJson();
     virtual void SetPowerSaveMode(bool enabled) = 0;
@@ -0,0 +1,222 @@
+#include "resumable_tls_transport.h"
+#include "tls_session_cache.h"
+#include "dns_cache.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_crt_bundle.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+
+#define TAG "ResumableTls"
+
+std::mutex ResumableTlsTransport::preconnect_mutex_;
+ResumableTlsTransport::PreconnectedSocket ResumableTlsTransport::preconnected_;
+
+void ResumableTlsTransport::Preconnect(const std::string& host, int port) {
+    {
+        std::lock_guard<std::mutex> lock(preconnect_mutex_);
+        if (preconnected_.connecting || (preconnected_.fd >= 0 && preconnected_.host == host && preconnected_.port == port &&
+            esp_timer_get_time() - preconnected_.time < TLS_PRECONNECT_MAX_AGE_MS * 1000)) {
+            return;
+        }
+        if (preconnected_.fd >= 0) {
+            close(preconnected_.fd);
+            preconnected_.fd = -1;
+        }
+        preconnected_.host = host;
+        preconnected_.port = port;
+        preconnected_.connecting = true;
+    }
+
+    xTaskCreate([](void* arg) {
+        int64_t start_time = esp_timer_get_time();
+        std::string host, ip;
+        int port;
+        {
+            std::lock_guard<std::mutex> lock(preconnect_mutex_);
+            host = preconnected_.host;
+            port = preconnected_.port;
+        }
+        int fd = -1;
+        if (DnsCache::GetInstance().Resolve(host, ip)) {
+            struct sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            inet_aton(ip.c_str(), &address.sin_addr);
+            fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if (fd >= 0 && connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        ESP_LOGI(TAG, "Preconnect to %s:%d %s in %lld ms", host.c_str(), port, fd >= 0 ? "done" : "failed",
+            (esp_timer_get_time() - start_time) / 1000);
+
+        {
+            std::lock_guard<std::mutex> lock(preconnect_mutex_);
+            preconnected_.fd = fd;
+            preconnected_.time = esp_timer_get_time();
+            preconnected_.connecting = false;
+        }
+        vTaskDelete(NULL);
+    }, "tls_preconnect", 4096, nullptr, 3, nullptr);
+}
+
+int ResumableTlsTransport::TakePreconnected(const std::string& host, int port) {
+    std::lock_guard<std::mutex> lock(preconnect_mutex_);
+    int fd = preconnected_.fd;
+    if (fd < 0) {
+        return -1;
+    }
+    preconnected_.fd = -1;
+    if (preconnected_.host != host || preconnected_.port != port ||
+        esp_timer_get_time() - preconnected_.time >= TLS_PRECONNECT_MAX_AGE_MS * 1000) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+ResumableTlsTransport::ResumableTlsTransport() {
+    mbedtls_net_init(&net_);
+    mbedtls_ssl_init(&ssl_);
+    mbedtls_ssl_config_init(&conf_);
+    mbedtls_entropy_init(&entropy_);
+    mbedtls_ctr_drbg_init(&ctr_drbg_);
+}
+
+ResumableTlsTransport::~ResumableTlsTransport() {
+    Disconnect();
+    mbedtls_ssl_free(&ssl_);
+    mbedtls_ssl_config_free(&conf_);
+    mbedtls_ctr_drbg_free(&ctr_drbg_);
+    mbedtls_entropy_free(&entropy_);
+}
+
+bool ResumableTlsTransport::Connect(const char* host, int port) {
+    int64_t start_time = esp_timer_get_time();
+    int ret;
+    bool dns_cached = true;
+    int64_t dns_done = start_time;
+    net_.fd = TakePreconnected(host, port);
+    bool preconnected = net_.fd >= 0;
+    if (!preconnected) {
+        // The name comes from the cache, SNI and the session cache still use the host name
+        std::string ip;
+        if (!DnsCache::GetInstance().Resolve(host, ip, &dns_cached)) {
+            ESP_LOGE(TAG, "Failed to resolve %s", host);
+            return false;
+        }
+        dns_done = esp_timer_get_time();
+        std::string port_str = std::to_string(port);
+        ret = mbedtls_net_connect(&net_, ip.c_str(), port_str.c_str(), MBEDTLS_NET_PROTO_TCP);
+        if (ret != 0) {
+            ESP_LOGE(TAG, "Failed to connect to %s:%d: -0x%x", host, port, -ret);
+            return false;
+        }
+    }
+    int64_t handshake_start = esp_timer_get_time();
+
+    if (!ssl_ready_) {
+        ret = mbedtls_ctr_drbg_seed(&ctr_drbg_, mbedtls_entropy_func, &entropy_, nullptr, 0);
+        if (ret == 0) {
+            ret = mbedtls_ssl_config_defaults(&conf_, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+        }
+        if (ret != 0) {
+            ESP_LOGE(TAG, "Failed to set up TLS: -0x%x", -ret);
+            Disconnect();
+            return false;
+        }
+        mbedtls_ssl_conf_authmode(&conf_, MBEDTLS_SSL_VERIFY_REQUIRED);
+        esp_crt_bundle_attach(&conf_);
+        mbedtls_ssl_conf_rng(&conf_, mbedtls_ctr_drbg_random, &ctr_drbg_);
+        mbedtls_ssl_conf_session_tickets(&conf_, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+        ssl_ready_ = true;
+    } else {
+        mbedtls_ssl_free(&ssl_);
+        mbedtls_ssl_init(&ssl_);
+    }
+    ret = mbedtls_ssl_setup(&ssl_, &conf_);
+    if (ret == 0) {
+        ret = mbedtls_ssl_set_hostname(&ssl_, host);
+    }
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to set up TLS: -0x%x", -ret);
+        Disconnect();
+        return false;
+    }
+    mbedtls_ssl_set_bio(&ssl_, &net_, mbedtls_net_send, mbedtls_net_recv, nullptr);
+
+    auto& cache = TlsSessionCache::GetInstance();
+    bool offered = cache.Restore(host, port, &ssl_);
+    // The server certificate is only sent on a full handshake, a resumed one skips that state
+    bool full_handshake = false;
+    while (!mbedtls_ssl_is_handshake_over(&ssl_)) {
+        if (ssl_.MBEDTLS_PRIVATE(state) == MBEDTLS_SSL_SERVER_CERTIFICATE) {
+            full_handshake = true;
+        }
+        ret = mbedtls_ssl_handshake_step(&ssl_);
+        if (ret != 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            ESP_LOGE(TAG, "TLS handshake with %s failed: -0x%x", host, -ret);
+            if (offered) {
+                cache.Forget(host, port);
+            }
+            Disconnect();
+            return false;
+        }
+    }
+
+    bool resumed = offered && !full_handshake;
+    cache.Save(host, port, &ssl_, resumed);
+    cache.RecordHandshake("websocket", esp_timer_get_time() - handshake_start, resumed);
+    ESP_LOGI(TAG, "Connected to %s:%d in %lld ms: dns %lld ms%s, tcp %lld ms%s, tls %lld ms",
+        host, port, (esp_timer_get_time() - start_time) / 1000,
+        (dns_done - start_time) / 1000, dns_cached ? " (cached)" : "",
+        (handshake_start - dns_done) / 1000, preconnected ? " (preconnected)" : "",
+        (esp_timer_get_time() - handshake_start) / 1000);
+    connected_ = true;
+    return true;
+}
+
+void ResumableTlsTransport::Disconnect() {
+    if (connected_) {
+        mbedtls_ssl_close_notify(&ssl_);
+    }
+    mbedtls_net_free(&net_);
+    connected_ = false;
+}
+
+int ResumableTlsTransport::Send(const char* data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        int ret = mbedtls_ssl_write(&ssl_, (const unsigned char*)data + sent, length - sent);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        if (ret <= 0) {
+            ESP_LOGE(TAG, "Failed to send: -0x%x", -ret);
+            connected_ = false;
+            return -1;
+        }
+        sent += ret;
+    }
+    return sent;
+}
+
+int ResumableTlsTransport::Receive(char* buffer, size_t bufferSize) {
+    int ret;
+    do {
+        ret = mbedtls_ssl_read(&ssl_, (unsigned char*)buffer, bufferSize);
+    } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+    if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == 0) {
+        connected_ = false;
+        return 0;
+    }
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to receive: -0x%x", -ret);
+        connected_ = false;
+    }
+    return ret;
+}
@@ -0,0 +1,55 @@
+#ifndef _RESUMABLE_TLS_TRANSPORT_H_
+#define _RESUMABLE_TLS_TRANSPORT_H_
+
+#include <transport.h>
+
+#include <mbedtls/ssl.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+
+#include <string>
+#include <mutex>
+#include <cstdint>
+
+// A pre-connected socket not taken by a connect within this time is closed
+#define TLS_PRECONNECT_MAX_AGE_MS 10000
+
+// TLS over a Wi-Fi socket that offers the session cached for the host to the server,
+// so reconnects to the same server skip the certificate exchange and key agreement
+class ResumableTlsTransport : public Transport {
+public:
+    ResumableTlsTransport();
+    ~ResumableTlsTransport();
+
+    bool Connect(const char* host, int port) override;
+    void Disconnect() override;
+    int Send(const char* data, size_t length) override;
+    int Receive(char* buffer, size_t bufferSize) override;
+
+    // Opens the TCP connection ahead of time on a background task, the next Connect
+    // to the same host and port starts the TLS handshake on it
+    static void Preconnect(const std::string& host, int port);
+
+private:
+    struct PreconnectedSocket {
+        std::string host;
+        int port = 0;
+        int fd = -1;
+        bool connecting = false;
+        int64_t time = 0;
+    };
+    static std::mutex preconnect_mutex_;
+    static PreconnectedSocket preconnected_;
+
+    static int TakePreconnected(const std::string& host, int port);
+
+    mbedtls_net_context net_;
+    mbedtls_ssl_context ssl_;
+    mbedtls_ssl_config conf_;
+    mbedtls_entropy_context entropy_;
+    mbedtls_ctr_drbg_context ctr_drbg_;
+    bool ssl_ready_ = false;
+};
+
+#endif // _RESUMABLE_TLS_TRANSPORT_H_
@@ -5,6 +5,7 @@
 #include "system_info.h"
 #include "font_awesome_symbols.h"
 #include "settings.h"
+#include "resumable_tls_transport.h"
 #include "assets/lang_config.h"
 
 #include <freertos/FreeRTOS.h>
@@ -13,9 +14,9 @@
 #include <esp_mqtt.h>
 #include <esp_udp.h>
 #include <tcp_transport.h>
-#include <tls_transport.h>
 #include <web_socket.h>
 #include <esp_log.h>
+#include <algorithm>
 
 #include <wifi_station.h>
 #include <wifi_configuration_ap.h>
@@ -120,7 +121,7 @@ WebSocket* WifiBoard::CreateWebSocket() {
 #ifdef CONFIG_CONNECTION_TYPE_WEBSOCKET
     std::string url = CONFIG_WEBSOCKET_URL;
     if (url.find("wss://") == 0) {
-        return new WebSocket(new TlsTransport());
+        return new WebSocket(new ResumableTlsTransport());
     } else {
         return new WebSocket(new TcpTransport());
     }
@@ -136,6 +137,10 @@ Udp* WifiBoard::CreateUdp() {
     return new EspUdp();
 }
 
+void WifiBoard::Preconnect(const std::string& host, int port) {
+    ResumableTlsTransport::Preconnect(host, port);
+}
+
 const char* WifiBoard::GetNetworkStateIcon() {
     if (wifi_config_mode_) {
         return FONT_AWESOME_WIFI;
@@ -154,6 +159,16 @@ const char* WifiBoard::GetNetworkStateIcon() {
     }
 }
 
+int WifiBoard::GetSignalQuality() {
+    auto& wifi_station = WifiStation::GetInstance();
+    if (wifi_config_mode_ || !wifi_station.IsConnected()) {
+        return -1;
+    }
+    // Map -90..-50 dBm to 0..100
+    int rssi = wifi_station.GetRssi();
+    return std::min(100, std::max(0, (rssi + 90) * 100 / 40));
+}
+
 std::string WifiBoard::GetBoardJson() {
     // Set the board type for OTA
     auto& wifi_station = WifiStation::GetInstance();
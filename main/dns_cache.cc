@@ -0,0 +1,264 @@
+#include "dns_cache.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+#include <lwip/dns.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "DnsCache"
+
+bool DnsCache::ParseUrl(const std::string& url, std::string& host, int& port) {
+    size_t scheme_end = url.find("://");
+    if (scheme_end == std::string::npos) {
+        return false;
+    }
+    std::string scheme = url.substr(0, scheme_end);
+    size_t host_start = scheme_end + 3;
+    size_t host_end = url.find_first_of(":/", host_start);
+    host = url.substr(host_start, host_end == std::string::npos ? std::string::npos : host_end - host_start);
+    if (host_end != std::string::npos && url[host_end] == ':') {
+        port = atoi(url.c_str() + host_end + 1);
+    } else {
+        port = (scheme == "https" || scheme == "wss" || scheme == "mqtts") ? 443 : 80;
+    }
+    return !host.empty();
+}
+
+bool DnsCache::Resolve(const std::string& host, std::string& ip, bool* cached, bool lwip_client) {
+    struct in_addr addr;
+    if (inet_aton(host.c_str(), &addr)) {
+        ip = host;
+        if (cached != nullptr) {
+            *cached = true;
+        }
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(host);
+        if (it != entries_.end() && it->second.expires_us > esp_timer_get_time()) {
+            ip = it->second.ip;
+            hit_count_++;
+            if (cached != nullptr) {
+                *cached = true;
+            }
+            return true;
+        }
+    }
+
+    if (cached != nullptr) {
+        *cached = false;
+    }
+    if (!Lookup(host, lwip_client)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ip = entries_[host].ip;
+    return true;
+}
+
+bool DnsCache::Lookup(const std::string& host, bool warm_lwip) {
+    int64_t start_time = esp_timer_get_time();
+    std::string ip;
+    uint32_t ttl = DNS_DEFAULT_TTL_SECONDS;
+    bool ok = Query(host, ip, ttl);
+    if (!ok || warm_lwip) {
+        // Also the fallback when the direct query fails, lwIP does not expose the TTL
+        struct addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* result = nullptr;
+        if (getaddrinfo(host.c_str(), nullptr, &hints, &result) == 0 && result != nullptr) {
+            if (!ok) {
+                char buffer[INET_ADDRSTRLEN];
+                inet_ntoa_r(((struct sockaddr_in*)result->ai_addr)->sin_addr, buffer, sizeof(buffer));
+                ip = buffer;
+                ttl = DNS_DEFAULT_TTL_SECONDS;
+                ok = true;
+            }
+            freeaddrinfo(result);
+        }
+    }
+    uint32_t elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = entries_[host];
+    if (!ok) {
+        // An address that is still valid is kept, background lookups back off
+        int backoff = std::min(DNS_RETRY_BACKOFF_SECONDS << std::min(entry.failures, 5), DNS_RETRY_BACKOFF_MAX_SECONDS);
+        entry.failures++;
+        entry.retry_after_us = esp_timer_get_time() + (int64_t)backoff * 1000000;
+        ESP_LOGW(TAG, "Failed to resolve %s after %lu ms, retry in %d s", host.c_str(), elapsed_ms, backoff);
+        return false;
+    }
+
+    entry.failures = 0;
+    entry.retry_after_us = 0;
+    entry.ip = ip;
+    ttl = std::max<uint32_t>(ttl, DNS_MIN_TTL_SECONDS);
+    int64_t now = esp_timer_get_time();
+    entry.expires_us = now + (int64_t)ttl * 1000000;
+    entry.refresh_us = entry.expires_us - (int64_t)std::min<uint32_t>(DNS_REFRESH_MARGIN_SECONDS, ttl / 2) * 1000000;
+    lookup_count_++;
+    lookup_total_ms_ += elapsed_ms;
+    ESP_LOGI(TAG, "%s -> %s in %lu ms, ttl %lu s (lookups %lu avg %lu ms, cache hits %lu)",
+        host.c_str(), ip.c_str(), elapsed_ms, ttl, lookup_count_, lookup_total_ms_ / lookup_count_, hit_count_);
+    return true;
+}
+
+// Minimal A query to the first configured DNS server, only to learn the TTL of the answer
+bool DnsCache::Query(const std::string& host, std::string& ip, uint32_t& ttl) {
+    const ip_addr_t* server = dns_getserver(0);
+    if (server == nullptr || ip_addr_isany(server) || !IP_IS_V4(server)) {
+        return false;
+    }
+
+    uint8_t packet[512];
+    uint16_t id = esp_random() & 0xffff;
+    size_t length = 0;
+    packet[length++] = id >> 8;
+    packet[length++] = id & 0xff;
+    packet[length++] = 0x01; // recursion desired
+    packet[length++] = 0x00;
+    const uint8_t counts[] = {0, 1, 0, 0, 0, 0, 0, 0};
+    memcpy(&packet[length], counts, sizeof(counts));
+    length += sizeof(counts);
+    size_t label_start = 0;
+    while (label_start <= host.size()) {
+        size_t label_end = host.find('.', label_start);
+        if (label_end == std::string::npos) {
+            label_end = host.size();
+        }
+        size_t label_length = label_end - label_start;
+        if (label_length == 0 || label_length > 63 || length + label_length + 6 > sizeof(packet)) {
+            return false;
+        }
+        packet[length++] = label_length;
+        memcpy(&packet[length], host.data() + label_start, label_length);
+        length += label_length;
+        label_start = label_end + 1;
+    }
+    const uint8_t question[] = {0, 0, 1, 0, 1}; // root, type A, class IN
+    memcpy(&packet[length], question, sizeof(question));
+    length += sizeof(question);
+
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        return false;
+    }
+    struct timeval timeout = {DNS_QUERY_TIMEOUT_MS / 1000, (DNS_QUERY_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(53);
+    address.sin_addr.s_addr = ip_2_ip4(server)->addr;
+    int received = -1;
+    if (sendto(fd, packet, length, 0, (struct sockaddr*)&address, sizeof(address)) == (int)length) {
+        received = recv(fd, packet, sizeof(packet), 0);
+    }
+    close(fd);
+    if (received < 12 || ((packet[0] << 8) | packet[1]) != id || (packet[3] & 0x0f) != 0) {
+        return false;
+    }
+
+    // Skip the question, it has the same length as the one sent
+    size_t offset = length;
+    int answers = (packet[6] << 8) | packet[7];
+    uint32_t min_ttl = UINT32_MAX;
+    for (int i = 0; i < answers; i++) {
+        // Names in answers are usually a compression pointer
+        while (offset < (size_t)received && packet[offset] != 0 && (packet[offset] & 0xc0) != 0xc0) {
+            offset += packet[offset] + 1;
+        }
+        offset += (offset < (size_t)received && packet[offset] != 0) ? 2 : 1;
+        if (offset + 10 > (size_t)received) {
+            return false;
+        }
+        uint16_t type = (packet[offset] << 8) | packet[offset + 1];
+        uint32_t record_ttl = ((uint32_t)packet[offset + 4] << 24) | (packet[offset + 5] << 16) |
+            (packet[offset + 6] << 8) | packet[offset + 7];
+        uint16_t data_length = (packet[offset + 8] << 8) | packet[offset + 9];
+        offset += 10;
+        if (offset + data_length > (size_t)received) {
+            return false;
+        }
+        // A CNAME chain expires with its shortest record
+        min_ttl = std::min(min_ttl, record_ttl);
+        if (type == 1 && data_length == 4) {
+            char buffer[INET_ADDRSTRLEN];
+            snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", packet[offset], packet[offset + 1], packet[offset + 2], packet[offset + 3]);
+            ip = buffer;
+            ttl = min_ttl > 0 ? min_ttl : DNS_DEFAULT_TTL_SECONDS;
+            return true;
+        }
+        offset += data_length;
+    }
+    return false;
+}
+
+bool DnsCache::StartLookupTask(const std::string& host) {
+    auto& entry = entries_[host];
+    if (entry.lookup_running) {
+        return true;
+    }
+    entry.lookup_running = true;
+    refreshing_++;
+    auto arg = new std::string(host);
+    BaseType_t created = xTaskCreate([](void* arg) {
+        auto host = (std::string*)arg;
+        auto& cache = DnsCache::GetInstance();
+        cache.Lookup(*host, true);
+        {
+            std::lock_guard<std::mutex> lock(cache.mutex_);
+            cache.entries_[*host].lookup_running = false;
+        }
+        cache.refreshing_--;
+        delete host;
+        vTaskDelete(NULL);
+    }, "dns_lookup", 4096, arg, 2, nullptr);
+    if (created != pdPASS) {
+        ESP_LOGW(TAG, "Failed to create the lookup task for %s", host.c_str());
+        entry.lookup_running = false;
+        refreshing_--;
+        delete arg;
+        return false;
+    }
+    return true;
+}
+
+void DnsCache::Prefetch(const std::vector<std::string>& hosts) {
+    struct in_addr addr;
+    for (auto& host : hosts) {
+        if (!host.empty() && !inet_aton(host.c_str(), &addr)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            entries_.emplace(host, Entry());
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    for (auto& entry : entries_) {
+        if (entry.second.expires_us == 0 && entry.second.retry_after_us <= now && !StartLookupTask(entry.first)) {
+            break;
+        }
+    }
+}
+
+void DnsCache::RefreshExpiring() {
+    if (refreshing_ > 0) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : entries_) {
+        // Failed hosts wait out their backoff instead of a new task on every tick while offline
+        if (entry.second.refresh_us <= now && entry.second.retry_after_us <= now && !StartLookupTask(entry.first)) {
+            break;
+        }
+    }
+}
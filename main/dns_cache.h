@@ -0,0 +1,73 @@
+#ifndef _DNS_CACHE_H_
+#define _DNS_CACHE_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+// Used when the answer carries no usable TTL, or the direct query failed
+#define DNS_DEFAULT_TTL_SECONDS 300
+// Entries are refreshed in the background this long before they expire, or halfway through
+// a shorter TTL
+#define DNS_REFRESH_MARGIN_SECONDS 30
+// Shorter TTLs are stretched to this, the servers do not move that often
+#define DNS_MIN_TTL_SECONDS 30
+#define DNS_QUERY_TIMEOUT_MS 2000
+// A host that failed to resolve is not looked up in the background for this long,
+// doubling with every failure in a row
+#define DNS_RETRY_BACKOFF_SECONDS 10
+#define DNS_RETRY_BACKOFF_MAX_SECONDS 300
+
+// IPv4 addresses of the servers this device talks to, kept for the TTL of the DNS answer.
+// Lookups query the configured DNS server directly to learn the TTL, background lookups
+// also go through getaddrinfo so the lwIP table is warm for clients that resolve on their own.
+class DnsCache {
+public:
+    static DnsCache& GetInstance() {
+        static DnsCache instance;
+        return instance;
+    }
+    DnsCache(const DnsCache&) = delete;
+    DnsCache& operator=(const DnsCache&) = delete;
+
+    // Returns the cached address if still valid, otherwise looks it up now. Set lwip_client
+    // for hosts a component client resolves itself, a miss then warms the lwIP table too.
+    bool Resolve(const std::string& host, std::string& ip, bool* cached = nullptr, bool lwip_client = false);
+    // Looks up all hosts in parallel, without waiting for the answers
+    void Prefetch(const std::vector<std::string>& hosts);
+    // Call while idle: looks up again the entries close to expiry
+    void RefreshExpiring();
+
+    // Splits scheme://host[:port]/path, the port defaults from the scheme
+    static bool ParseUrl(const std::string& url, std::string& host, int& port);
+
+private:
+    DnsCache() = default;
+
+    struct Entry {
+        std::string ip;
+        int64_t expires_us = 0;
+        int64_t refresh_us = 0;
+        int failures = 0;
+        int64_t retry_after_us = 0;
+        // A background lookup is under way, a second prefetch of the host waits for it
+        bool lookup_running = false;
+    };
+
+    std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+    std::atomic<int> refreshing_{0};
+    uint32_t lookup_count_ = 0;
+    uint32_t lookup_total_ms_ = 0;
+    uint32_t hit_count_ = 0;
+
+    bool Lookup(const std::string& host, bool warm_lwip);
+    static bool Query(const std::string& host, std::string& ip, uint32_t& ttl);
+    // Called with mutex_ held, false if the task could not be created
+    bool StartLookupTask(const std::string& host);
+};
+
+#endif // _DNS_CACHE_H_
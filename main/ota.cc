@@ -2,10 +2,13 @@
 #include "system_info.h"
 #include "board.h"
 #include "settings.h"
+#include "tls_session_cache.h"
+#include "dns_cache.h"
 #include "assets/lang_config.h"
 
 #include <cJSON.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <esp_partition.h>
 #include <esp_ota_ops.h>
 #include <esp_app_format.h>
@@ -60,11 +63,23 @@ bool Ota::CheckVersion() {
 
     std::string post_data = board.GetJson();
     std::string method = post_data.length() > 0 ? "POST" : "GET";
+    // The HTTP client resolves on its own, this takes the lookup out of the open time
+    std::string host, ip;
+    int port;
+    bool dns_cached = false;
+    int64_t dns_time = esp_timer_get_time();
+    if (board.GetBoardType() == "wifi" && DnsCache::ParseUrl(check_version_url_, host, port)) {
+        DnsCache::GetInstance().Resolve(host, ip, &dns_cached, true);
+    }
+    int64_t open_time = esp_timer_get_time();
+    ESP_LOGI(TAG, "DNS %lld ms%s", (open_time - dns_time) / 1000, dns_cached ? " (cached)" : "");
     if (!http->Open(method, check_version_url_, post_data)) {
         ESP_LOGE(TAG, "Failed to open HTTP connection");
         delete http;
         return false;
     }
+    // The HTTP client owns its TLS context, this covers connect, handshake and the request
+    TlsSessionCache::GetInstance().RecordHandshake("ota", esp_timer_get_time() - open_time, false);
 
     auto response = http->GetBody();
     http->Close();
@@ -104,11 +119,30 @@ bool Ota::CheckVersion() {
                 if (settings.GetString(item->string) != item->valuestring) {
                     settings.SetString(item->string, item->valuestring);
                 }
+            } else if (item->type == cJSON_Array) {
+                // Lists such as "endpoints" are kept space separated
+                auto list = JoinStringArray(item);
+                if (settings.GetString(item->string) != list) {
+                    settings.SetString(item->string, list);
+                }
             }
         }
         has_mqtt_config_ = true;
     }
 
+    // Ordered websocket servers, tried before CONFIG_WEBSOCKET_URL
+    cJSON *websocket = cJSON_GetObjectItem(root, "websocket");
+    if (websocket != NULL) {
+        cJSON *urls = cJSON_GetObjectItem(websocket, "urls");
+        if (cJSON_IsArray(urls)) {
+            Settings settings("websocket", true);
+            auto list = JoinStringArray(urls);
+            if (settings.GetString("urls") != list) {
+                settings.SetString("urls", list);
+            }
+        }
+    }
+
     has_server_time_ = false;
     cJSON *server_time = cJSON_GetObjectItem(root, "server_time");
     if (server_time != NULL) {
@@ -165,6 +199,20 @@ bool Ota::CheckVersion() {
     return true;
 }
 
+std::string Ota::JoinStringArray(const cJSON* array) {
+    std::string list;
+    const cJSON* item = NULL;
+    cJSON_ArrayForEach(item, array) {
+        if (cJSON_IsString(item)) {
+            if (!list.empty()) {
+                list += " ";
+            }
+            list += item->valuestring;
+        }
+    }
+    return list;
+}
+
 void Ota::MarkCurrentVersionValid() {
     auto partition = esp_ota_get_running_partition();
     if (strcmp(partition->label, "factory") == 0) {
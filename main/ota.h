@@ -4,6 +4,8 @@
 #include <functional>
 #include <string>
 #include <map>
+#include <vector>
+#include <cJSON.h>
 
 class Ota {
 public:
@@ -42,6 +44,7 @@ private:
     std::function<void(int progress, size_t speed)> upgrade_callback_;
     std::vector<int> ParseVersion(const std::string& version);
     bool IsNewVersionAvailable(const std::string& currentVersion, const std::string& newVersion);
+    static std::string JoinStringArray(const cJSON* array);
 };
 
 #endif // _OTA_H
@@ -0,0 +1,204 @@
+#include "endpoint_selector.h"
+#include "dns_cache.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <algorithm>
+
+#define TAG "EndpointSelector"
+
+std::vector<std::string> EndpointSelector::SplitList(const std::string& list) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find_first_of(" ,;", start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        if (end > start) {
+            items.push_back(list.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return items;
+}
+
+void EndpointSelector::Add(const std::string& address, const std::string& host, int port) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& endpoint : endpoints_) {
+        if (endpoint.address == address) {
+            return;
+        }
+    }
+    Endpoint endpoint;
+    endpoint.address = address;
+    endpoint.host = host;
+    endpoint.port = port;
+    endpoints_.push_back(endpoint);
+}
+
+void EndpointSelector::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    endpoints_.clear();
+}
+
+size_t EndpointSelector::size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return endpoints_.size();
+}
+
+std::vector<std::string> EndpointSelector::Hosts() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> hosts;
+    for (auto& endpoint : endpoints_) {
+        if (std::find(hosts.begin(), hosts.end(), endpoint.host) == hosts.end()) {
+            hosts.push_back(endpoint.host);
+        }
+    }
+    return hosts;
+}
+
+std::string EndpointSelector::Current() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    const Endpoint* best = nullptr;
+    // Unprobed endpoints rank behind the measured ones and ahead of the unreachable ones,
+    // ties keep the list order
+    auto rank = [](const Endpoint* endpoint) {
+        return endpoint->rtt_ms == 0 ? UINT32_MAX - 1 : endpoint->rtt_ms;
+    };
+    for (auto& endpoint : endpoints_) {
+        if (endpoint.failed_until > now) {
+            continue;
+        }
+        if (best == nullptr || rank(&endpoint) < rank(best)) {
+            best = &endpoint;
+        }
+    }
+    if (best == nullptr) {
+        // Everything failed recently, retry the one that comes back first
+        for (auto& endpoint : endpoints_) {
+            if (best == nullptr || endpoint.failed_until < best->failed_until) {
+                best = &endpoint;
+            }
+        }
+    }
+    return best != nullptr ? best->address : std::string();
+}
+
+void EndpointSelector::ReportSuccess(const std::string& address) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& endpoint : endpoints_) {
+        if (endpoint.address == address) {
+            endpoint.failures = 0;
+            endpoint.failed_until = 0;
+        }
+    }
+}
+
+void EndpointSelector::ReportFailure(const std::string& address) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    for (auto& endpoint : endpoints_) {
+        // Repeated reports of the same outage count once
+        if (endpoint.address != address || endpoint.failed_until > now) {
+            continue;
+        }
+        int backoff = std::min(ENDPOINT_FAILURE_BACKOFF_SECONDS << std::min(endpoint.failures, 5),
+            ENDPOINT_FAILURE_BACKOFF_MAX_SECONDS);
+        endpoint.failures++;
+        endpoint.failed_until = now + (int64_t)backoff * 1000000;
+        ESP_LOGW(TAG, "Endpoint %s failed (%d in a row), skipped for %d s",
+            address.c_str(), endpoint.failures, backoff);
+    }
+}
+
+bool EndpointSelector::IsHealthy(const std::string& address) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    for (auto& endpoint : endpoints_) {
+        if (endpoint.address == address) {
+            return endpoint.failed_until <= now;
+        }
+    }
+    return false;
+}
+
+void EndpointSelector::ProbeAsync() {
+    if (size() < 2 || probing_.exchange(true)) {
+        return;
+    }
+    xTaskCreate([](void* arg) {
+        auto selector = (EndpointSelector*)arg;
+        selector->Probe();
+        selector->probing_ = false;
+        vTaskDelete(NULL);
+    }, "endpoint_probe", 4096, this, 1, nullptr);
+}
+
+void EndpointSelector::Probe() {
+    std::vector<std::pair<std::string, int>> targets;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& endpoint : endpoints_) {
+            targets.emplace_back(endpoint.host, endpoint.port);
+        }
+    }
+    for (size_t i = 0; i < targets.size(); i++) {
+        int rtt_ms = MeasureConnect(targets[i].first, targets[i].second);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (i >= endpoints_.size() || endpoints_[i].host != targets[i].first) {
+            break;
+        }
+        auto& endpoint = endpoints_[i];
+        if (rtt_ms < 0) {
+            // Unreachable: leave it to the connect path to mark it failed, just rank it last
+            endpoint.rtt_ms = UINT32_MAX;
+        } else {
+            uint32_t rtt = std::max(rtt_ms, 1);
+            endpoint.rtt_ms = (endpoint.rtt_ms == 0 || endpoint.rtt_ms == UINT32_MAX) ? rtt : (endpoint.rtt_ms * 3 + rtt) / 4;
+        }
+        ESP_LOGI(TAG, "Probe %s: %d ms (avg %lu ms)", endpoint.address.c_str(), rtt_ms,
+            endpoint.rtt_ms == UINT32_MAX ? 0 : endpoint.rtt_ms);
+    }
+    ESP_LOGI(TAG, "Preferred endpoint: %s", Current().c_str());
+}
+
+// Time of the TCP handshake, close to one round trip to the server. -1 if unreachable.
+int EndpointSelector::MeasureConnect(const std::string& host, int port) {
+    std::string ip;
+    if (!DnsCache::GetInstance().Resolve(host, ip)) {
+        return -1;
+    }
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_aton(ip.c_str(), &address.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    int64_t start_time = esp_timer_get_time();
+    int rtt_ms = -1;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0 || errno == EINPROGRESS) {
+        fd_set write_fds;
+        FD_ZERO(&write_fds);
+        FD_SET(fd, &write_fds);
+        struct timeval timeout = {ENDPOINT_PROBE_TIMEOUT_MS / 1000, (ENDPOINT_PROBE_TIMEOUT_MS % 1000) * 1000};
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (select(fd + 1, nullptr, &write_fds, nullptr, &timeout) == 1 &&
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+            rtt_ms = (esp_timer_get_time() - start_time) / 1000;
+        }
+    }
+    close(fd);
+    return rtt_ms;
+}
@@ -0,0 +1,60 @@
+#ifndef ENDPOINT_SELECTOR_H
+#define ENDPOINT_SELECTOR_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+#define ENDPOINT_PROBE_TIMEOUT_MS 2000
+#define ENDPOINT_PROBE_INTERVAL_SECONDS 300
+// A failed endpoint is skipped for this long, doubling with every failure in a row
+#define ENDPOINT_FAILURE_BACKOFF_SECONDS 30
+#define ENDPOINT_FAILURE_BACKOFF_MAX_SECONDS 600
+
+// Ordered list of servers for one protocol. Picks the healthy endpoint with the lowest
+// TCP connect time measured in the background, falls back to list order before the first
+// probe, and skips endpoints that failed recently.
+class EndpointSelector {
+public:
+    EndpointSelector() = default;
+
+    // address is what the protocol connects to (URL or host), host and port are probed
+    void Add(const std::string& address, const std::string& host, int port);
+    void Clear();
+    size_t size();
+    // Distinct host names of all endpoints, in list order
+    std::vector<std::string> Hosts();
+    // The endpoint the next connection should use, empty if there is none
+    std::string Current();
+    void ReportSuccess(const std::string& address);
+    // Connect error or timeout, the next Current() moves on
+    void ReportFailure(const std::string& address);
+    // False while the endpoint is skipped after a failure
+    bool IsHealthy(const std::string& address);
+    // Measures every endpoint on a background task, skipped while a probe runs
+    void ProbeAsync();
+
+    // Splits a list separated by spaces, commas or semicolons
+    static std::vector<std::string> SplitList(const std::string& list);
+
+private:
+    struct Endpoint {
+        std::string address;
+        std::string host;
+        int port = 0;
+        uint32_t rtt_ms = 0; // 0 until probed
+        int failures = 0;
+        int64_t failed_until = 0;
+    };
+
+    std::mutex mutex_;
+    std::vector<Endpoint> endpoints_;
+    std::atomic<bool> probing_{false};
+
+    void Probe();
+    static int MeasureConnect(const std::string& host, int port);
+};
+
+#endif // ENDPOINT_SELECTOR_H
@@ -0,0 +1,46 @@
+// Host stand-in for the few mbedtls AES calls UdpAudioCipher makes, built on OpenSSL's block
+// cipher. Only for udp_audio_packet_test.cc, the firmware uses the real mbedtls from ESP-IDF.
+#ifndef HOST_SHIM_MBEDTLS_AES_H
+#define HOST_SHIM_MBEDTLS_AES_H
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#include <openssl/aes.h>
+#include <cstring>
+#include <cstddef>
+
+typedef struct {
+    AES_KEY key;
+} mbedtls_aes_context;
+
+inline void mbedtls_aes_init(mbedtls_aes_context* ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+inline void mbedtls_aes_free(mbedtls_aes_context* ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+inline int mbedtls_aes_setkey_enc(mbedtls_aes_context* ctx, const unsigned char* key, unsigned int keybits) {
+    return AES_set_encrypt_key(key, keybits, &ctx->key) == 0 ? 0 : -1;
+}
+
+// Same contract as mbedtls: the whole 16 byte block is a big endian counter
+inline int mbedtls_aes_crypt_ctr(mbedtls_aes_context* ctx, size_t length, size_t* nc_off,
+    unsigned char nonce_counter[16], unsigned char stream_block[16], const unsigned char* input, unsigned char* output) {
+    size_t n = *nc_off;
+    for (size_t i = 0; i < length; i++) {
+        if (n == 0) {
+            AES_encrypt(nonce_counter, stream_block, &ctx->key);
+            for (int j = 15; j >= 0 && ++nonce_counter[j] == 0; j--) {
+            }
+        }
+        output[i] = input[i] ^ stream_block[n];
+        n = (n + 1) & 0x0F;
+    }
+    *nc_off = n;
+    return 0;
+}
+#pragma GCC diagnostic pop
+
+#endif // HOST_SHIM_MBEDTLS_AES_H
@@ -2,10 +2,14 @@
 #include "board.h"
 #include "application.h"
 #include "settings.h"
+#include "tls_session_cache.h"
+#include "dns_cache.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <ml307_mqtt.h>
 #include <ml307_udp.h>
+#include <mbedtls/md.h>
 #include <cstring>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
@@ -14,10 +18,28 @@
 
 MqttProtocol::MqttProtocol() {
     event_group_handle_ = xEventGroupCreate();
+
+    esp_timer_create_args_t resume_timer_args = {
+        .callback = [](void* arg) {
+            auto protocol = (MqttProtocol*)arg;
+            if (protocol->resume_pending_.exchange(false)) {
+                ESP_LOGW(TAG, "Resumed session was not confirmed, dropping the ticket");
+                protocol->resume_ticket_.token.clear();
+                protocol->SetError(Lang::Strings::SERVER_TIMEOUT);
+            }
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "mqtt_resume",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&resume_timer_args, &resume_timer_);
 }
 
 MqttProtocol::~MqttProtocol() {
     ESP_LOGI(TAG, "MqttProtocol deinit");
+    esp_timer_stop(resume_timer_);
+    esp_timer_delete(resume_timer_);
     if (udp_ != nullptr) {
         delete udp_;
     }
@@ -35,10 +57,19 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     if (mqtt_ != nullptr) {
         ESP_LOGW(TAG, "Mqtt client already started");
         delete mqtt_;
+        mqtt_ = nullptr;
     }
 
+    // The OTA response may list several brokers, the single endpoint is the last fallback
     Settings settings("mqtt", false);
-    endpoint_ = settings.GetString("endpoint");
+    auto endpoints = EndpointSelector::SplitList(settings.GetString("endpoints"));
+    endpoints.push_back(settings.GetString("endpoint"));
+    for (auto& endpoint : endpoints) {
+        if (!endpoint.empty()) {
+            endpoints_.Add(endpoint, endpoint, 8883);
+        }
+    }
+    endpoint_ = endpoints_.Current();
     client_id_ = settings.GetString("client_id");
     username_ = settings.GetString("username");
     password_ = settings.GetString("password");
@@ -52,14 +83,51 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
         return false;
     }
 
-    mqtt_ = Board::GetInstance().CreateMqtt();
-    mqtt_->SetKeepAlive(90);
+    // Fail over through the list, the fastest healthy broker first
+    size_t attempts = endpoints_.size();
+    for (size_t attempt = 0; ; attempt++) {
+        endpoint_ = endpoints_.Current();
+        ESP_LOGI(TAG, "Connecting to endpoint %s", endpoint_.c_str());
+        // The MQTT client resolves on its own, this takes the lookup out of the connect time
+        int64_t dns_time = esp_timer_get_time();
+        std::string ip;
+        bool dns_cached = false;
+        if (Board::GetInstance().GetBoardType() == "wifi") {
+            DnsCache::GetInstance().Resolve(endpoint_, ip, &dns_cached, true);
+        }
+        int64_t connect_time = esp_timer_get_time();
+        ESP_LOGI(TAG, "DNS %lld ms%s", (connect_time - dns_time) / 1000, dns_cached ? " (cached)" : "");
+        mqtt_ = CreateMqttClient();
+        if (mqtt_->Connect(endpoint_, 8883, client_id_, username_, password_)) {
+            // The MQTT client owns its TLS context, this covers connect, handshake and CONNACK
+            TlsSessionCache::GetInstance().RecordHandshake("mqtt", esp_timer_get_time() - connect_time, false);
+            break;
+        }
+        ESP_LOGE(TAG, "Failed to connect to endpoint %s", endpoint_.c_str());
+        endpoints_.ReportFailure(endpoint_);
+        delete mqtt_;
+        mqtt_ = nullptr;
+        if (attempt + 1 >= attempts || IsOpenAbandoned()) {
+            SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+            return false;
+        }
+    }
+    connected_endpoint_ = endpoint_;
+    endpoints_.ReportSuccess(endpoint_);
 
-    mqtt_->OnDisconnected([this]() {
+    ESP_LOGI(TAG, "Connected to endpoint");
+    return true;
+}
+
+Mqtt* MqttProtocol::CreateMqttClient() {
+    auto mqtt = Board::GetInstance().CreateMqtt();
+    mqtt->SetKeepAlive(90);
+
+    mqtt->OnDisconnected([this]() {
         ESP_LOGI(TAG, "Disconnected from endpoint");
     });
 
-    mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
+    mqtt->OnMessage([this](const std::string& topic, const std::string& payload) {
         cJSON* root = cJSON_Parse(payload.c_str());
         if (root == nullptr) {
             ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
@@ -88,16 +156,7 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
         cJSON_Delete(root);
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
-
-    ESP_LOGI(TAG, "Connecting to endpoint %s", endpoint_.c_str());
-    if (!mqtt_->Connect(endpoint_, 8883, client_id_, username_, password_)) {
-        ESP_LOGE(TAG, "Failed to connect to endpoint");
-        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
-        return false;
-    }
-
-    ESP_LOGI(TAG, "Connected to endpoint");
-    return true;
+    return mqtt;
 }
 
 bool MqttProtocol::SendText(const std::string& text) {
@@ -112,7 +171,7 @@ bool MqttProtocol::SendText(const std::string& text) {
     return true;
 }
 
-void MqttProtocol::SendAudio(const std::vector<uint8_t>& data) {
+void MqttProtocol::WriteAudio(const std::vector<uint8_t>& data) {
     std::lock_guard<std::mutex> lock(channel_mutex_);
     if (udp_ == nullptr) {
         return;
@@ -134,29 +193,55 @@ void MqttProtocol::SendAudio(const std::vector<uint8_t>& data) {
         return;
     }
     udp_->Send(encrypted);
+    ReportFirstPacket();
 }
 
 void MqttProtocol::CloseAudioChannel() {
-    {
-        std::lock_guard<std::mutex> lock(channel_mutex_);
-        if (udp_ != nullptr) {
-            delete udp_;
-            udp_ = nullptr;
-        }
+    resume_pending_ = false;
+    esp_timer_stop(resume_timer_);
+
+    // MQTT keeps its own keepalive, only the UDP socket can be kept warm for the next session
+    if (!StartWarmWindow(HasUdp())) {
+        CloseTransport();
     }
 
+    // The goodbye goes after anything still on the control lane
     std::string message = "{";
     message += "\"session_id\":\"" + session_id_ + "\",";
     message += "\"type\":\"goodbye\"";
     message += "}";
-    SendText(message);
+    SendControl(message);
+    DrainControlLaneBeforeClose();
 
     if (on_audio_channel_closed_ != nullptr) {
         on_audio_channel_closed_();
     }
 }
 
+void MqttProtocol::CloseTransport() {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (udp_ != nullptr) {
+        delete udp_;
+        udp_ = nullptr;
+    }
+}
+
 bool MqttProtocol::OpenAudioChannel() {
+    // The broker connection idles between sessions, only a session that went silent is a failure
+    ReportSessionTimeout(HasUdp() && !warm_);
+    bool warm = warm_.exchange(false) && HasUdp();
+    std::string warm_server = udp_server_;
+    int warm_port = udp_port_;
+    BeginOpen(warm);
+
+    if (mqtt_ != nullptr && mqtt_->IsConnected() && !endpoints_.IsHealthy(connected_endpoint_)) {
+        // The broker stopped answering hellos or timed out, move to the next one
+        ESP_LOGW(TAG, "Endpoint %s failed, reconnecting", connected_endpoint_.c_str());
+        warm = false;
+        CloseTransport();
+        delete mqtt_;
+        mqtt_ = nullptr;
+    }
     if (mqtt_ == nullptr || !mqtt_->IsConnected()) {
         ESP_LOGI(TAG, "MQTT is not connected, try to connect now");
         if (!StartMqttClient(true)) {
@@ -168,32 +253,79 @@ bool MqttProtocol::OpenAudioChannel() {
     session_id_ = "";
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 
+    bool resuming = CanResume();
+    if (resuming) {
+        resume_ticket_.counter++;
+    }
+
     // 发送 hello 消息申请 UDP 通道
     std::string message = "{";
     message += "\"type\":\"hello\",";
     message += "\"version\": 3,";
     message += "\"transport\":\"udp\",";
+    if (resuming) {
+        char resume[64];
+        snprintf(resume, sizeof(resume), "\"resume\":{\"token\":\"%08lx\",\"counter\":%lu},",
+            ntohl(*(uint32_t*)resume_ticket_.token.data()), resume_ticket_.counter);
+        message += resume;
+    }
     message += "\"audio_params\":{";
-    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
+    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(uplink_frame_duration_);
+    message += AudioBatchHelloParams();
     message += "}}";
     if (!SendText(message)) {
         return false;
     }
 
+    if (resuming) {
+        // Zero round trip: the UDP endpoint is known and the key is derived locally,
+        // audio flows now and the server hello confirms the session later
+        resume_pending_ = true;
+        esp_timer_stop(resume_timer_);
+        esp_timer_start_once(resume_timer_, MQTT_RESUME_CONFIRM_TIMEOUT_MS * 1000);
+
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        ApplyResumeKey();
+        if (warm && udp_server_ == warm_server && udp_port_ == warm_port) {
+            ESP_LOGI(TAG, "Resuming on the warm UDP socket");
+        } else {
+            ConnectUdp();
+        }
+        ESP_LOGI(TAG, "Resuming session, ticket counter %lu", resume_ticket_.counter);
+        return true;
+    }
+
     // 等待服务器响应
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
-    if (!(bits & MQTT_PROTOCOL_SERVER_HELLO_EVENT)) {
+    if (!WaitForServerHello(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT, 10000)) {
         ESP_LOGE(TAG, "Failed to receive server hello");
+        if (!IsOpenAbandoned()) {
+            endpoints_.ReportFailure(connected_endpoint_);
+        }
         SetError(Lang::Strings::SERVER_TIMEOUT);
         return false;
     }
 
     std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (warm && udp_server_ == warm_server && udp_port_ == warm_port) {
+        // Same UDP endpoint as the last session, the new key and nonce are already in place
+        ESP_LOGI(TAG, "Reusing the warm UDP socket");
+        return true;
+    }
+    ConnectUdp();
+    return true;
+}
+
+// Called with channel_mutex_ held
+void MqttProtocol::ConnectUdp() {
     if (udp_ != nullptr) {
         delete udp_;
     }
     udp_ = Board::GetInstance().CreateUdp();
     udp_->OnMessage([this](const std::string& data) {
+        // Late packets of the previous session arrive while the socket is kept warm
+        if (warm_) {
+            return;
+        }
         if (data.size() < sizeof(aes_nonce_)) {
             ESP_LOGE(TAG, "Invalid audio packet size: %zu", data.size());
             return;
@@ -202,13 +334,10 @@ bool MqttProtocol::OpenAudioChannel() {
             ESP_LOGE(TAG, "Invalid audio packet type: %x", data[0]);
             return;
         }
+        // Late and out of order packets are passed on, the jitter buffer reorders or drops them
         uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
         if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+            ESP_LOGD(TAG, "Received audio packet with sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
         }
 
         std::vector<uint8_t> decrypted;
@@ -224,18 +353,59 @@ bool MqttProtocol::OpenAudioChannel() {
             return;
         }
         if (on_incoming_audio_ != nullptr) {
-            on_incoming_audio_(std::move(decrypted));
+            on_incoming_audio_(std::move(decrypted), sequence);
+        }
+        if ((int32_t)(sequence - remote_sequence_) > 0) {
+            remote_sequence_ = sequence;
         }
-        remote_sequence_ = sequence;
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     udp_->Connect(udp_server_, udp_port_);
+}
+
+bool MqttProtocol::CanResume() const {
+    return !resume_ticket_.token.empty() && !resume_ticket_.server.empty() &&
+        std::chrono::steady_clock::now() < resume_ticket_.expires;
+}
+
+// Derives a fresh key for this session, the server does the same from the token and counter
+// carried in every packet nonce. Called with channel_mutex_ held.
+void MqttProtocol::ApplyResumeKey() {
+    uint8_t input[8];
+    memcpy(input, resume_ticket_.token.data(), 4);
+    *(uint32_t*)&input[4] = htonl(resume_ticket_.counter);
+    uint8_t digest[32];
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+        (const uint8_t*)resume_ticket_.secret.data(), resume_ticket_.secret.size(),
+        input, sizeof(input), digest);
+
+    // type, reserved, size, token, counter, sequence
+    aes_nonce_.assign(16, '\0');
+    aes_nonce_[0] = 0x01;
+    memcpy(&aes_nonce_[4], input, sizeof(input));
+    mbedtls_aes_init(&aes_ctx_);
+    mbedtls_aes_setkey_enc(&aes_ctx_, digest, 128);
+    udp_server_ = resume_ticket_.server;
+    udp_port_ = resume_ticket_.port;
+    local_sequence_ = 0;
+    remote_sequence_ = 0;
+}
 
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
+void MqttProtocol::ParseResumeTicket(const cJSON* resume) {
+    auto token = cJSON_GetObjectItem(resume, "token");
+    auto secret = cJSON_GetObjectItem(resume, "secret");
+    auto ttl = cJSON_GetObjectItem(resume, "ttl");
+    if (!cJSON_IsString(token) || !cJSON_IsString(secret) || strlen(token->valuestring) != 8 ||
+        strlen(secret->valuestring) != 32) {
+        ESP_LOGW(TAG, "Invalid resume ticket");
+        return;
     }
-    return true;
+    resume_ticket_.token = DecodeHexString(token->valuestring);
+    resume_ticket_.secret = DecodeHexString(secret->valuestring);
+    resume_ticket_.counter = 0;
+    resume_ticket_.expires = std::chrono::steady_clock::now() +
+        std::chrono::seconds(cJSON_IsNumber(ttl) ? ttl->valueint : 3600);
 }
 
 void MqttProtocol::ParseServerHello(const cJSON* root) {
@@ -263,12 +433,37 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
             server_frame_duration_ = frame_duration->valueint;
         }
     }
+    ParseAudioBatch(audio_params);
+
+    bool was_resuming = resume_pending_.exchange(false);
+    if (was_resuming) {
+        esp_timer_stop(resume_timer_);
+    }
+    auto resume = cJSON_GetObjectItem(root, "resume");
+    bool resumed = was_resuming && cJSON_IsTrue(cJSON_GetObjectItem(root, "resumed"));
+    if (resumed) {
+        // The derived key stays, a rotated ticket is only used by the next session
+        ESP_LOGI(TAG, "Resumed session confirmed");
+        if (resume != nullptr) {
+            ParseResumeTicket(resume);
+        }
+        xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
+        return;
+    }
+    if (was_resuming) {
+        // Audio sent with the derived key is lost, switch to the parameters of a full hello
+        ESP_LOGW(TAG, "Server refused the resume ticket");
+        resume_ticket_.token.clear();
+    }
 
     auto udp = cJSON_GetObjectItem(root, "udp");
     if (udp == nullptr) {
         ESP_LOGE(TAG, "UDP is not specified");
         return;
     }
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    std::string last_server = udp_server_;
+    int last_port = udp_port_;
     udp_server_ = cJSON_GetObjectItem(udp, "server")->valuestring;
     udp_port_ = cJSON_GetObjectItem(udp, "port")->valueint;
     auto key = cJSON_GetObjectItem(udp, "key")->valuestring;
@@ -281,6 +476,15 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
     mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
     local_sequence_ = 0;
     remote_sequence_ = 0;
+    if (was_resuming && udp_ != nullptr && (udp_server_ != last_server || udp_port_ != last_port)) {
+        ConnectUdp();
+    }
+
+    if (resume != nullptr) {
+        ParseResumeTicket(resume);
+        resume_ticket_.server = udp_server_;
+        resume_ticket_.port = udp_port_;
+    }
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
@@ -304,5 +508,10 @@ std::string MqttProtocol::DecodeHexString(const std::string& hex_string) {
 }
 
 bool MqttProtocol::IsAudioChannelOpened() const {
-    return udp_ != nullptr && !error_occurred_ && !IsTimeout();
+    return HasUdp() && !warm_ && !error_occurred_ && !IsTimeout();
+}
+
+bool MqttProtocol::HasUdp() const {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    return udp_ != nullptr;
 }
@@ -9,6 +9,7 @@
 #include <mbedtls/aes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <esp_timer.h>
 
 #include <functional>
 #include <string>
@@ -20,16 +21,19 @@
 
 #define MQTT_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
 
+// A resumed session starts sending at once, the server hello must confirm it within this time
+#define MQTT_RESUME_CONFIRM_TIMEOUT_MS 10000
+
 class MqttProtocol : public Protocol {
 public:
     MqttProtocol();
     ~MqttProtocol();
 
     void Start() override;
-    void SendAudio(const std::vector<uint8_t>& data) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
+    const char* audio_path() const override { return "udp"; }
 
 private:
     EventGroupHandle_t event_group_handle_;
@@ -40,7 +44,7 @@ private:
     std::string password_;
     std::string publish_topic_;
 
-    std::mutex channel_mutex_;
+    mutable std::mutex channel_mutex_;
     Mqtt* mqtt_ = nullptr;
     Udp* udp_ = nullptr;
     mbedtls_aes_context aes_ctx_;
@@ -50,11 +54,35 @@ private:
     uint32_t local_sequence_;
     uint32_t remote_sequence_;
 
+    // Issued by the server in a hello, lets the next session send audio before the hello round trip
+    struct ResumeTicket {
+        std::string token;   // 4 bytes, identifies the ticket in the packet nonce
+        std::string secret;  // 16 bytes, session keys are derived from it
+        std::string server;
+        int port = 0;
+        uint32_t counter = 0;
+        std::chrono::steady_clock::time_point expires;
+    };
+    ResumeTicket resume_ticket_;
+    std::atomic<bool> resume_pending_{false};
+    esp_timer_handle_t resume_timer_ = nullptr;
+
     bool StartMqttClient(bool report_error=false);
+    Mqtt* CreateMqttClient();
     void ParseServerHello(const cJSON* root);
+    void ParseResumeTicket(const cJSON* resume);
+    bool CanResume() const;
+    void ApplyResumeKey();
+    void ConnectUdp();
+    // udp_ is replaced by the open task while the main loop asks whether the channel is up
+    bool HasUdp() const;
     std::string DecodeHexString(const std::string& hex_string);
 
     bool SendText(const std::string& text) override;
+    void WriteAudio(const std::vector<uint8_t>& data) override;
+    // Nonce, UDP and IP headers
+    int audio_write_overhead() const override { return 16 + 28; }
+    void CloseTransport() override;
 };
 
 
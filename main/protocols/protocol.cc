@@ -1,14 +1,26 @@
 #include "protocol.h"
+#include "application.h"
+#include "assets/lang_config.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <arpa/inet.h>
+#include <cstring>
+#include <algorithm>
 
 #define TAG "Protocol"
 
 void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
-    on_incoming_json_ = callback;
+    on_incoming_json_ = [this, callback](const cJSON* root) {
+        int64_t abort_time = abort_written_time_.exchange(0);
+        if (abort_time != 0) {
+            ESP_LOGI(TAG, "Abort answered: first server message %lld ms after the write", (esp_timer_get_time() - abort_time) / 1000);
+        }
+        callback(root);
+    };
 }
 
-void Protocol::OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data)> callback) {
+void Protocol::OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data, uint32_t sequence)> callback) {
     on_incoming_audio_ = callback;
 }
 
@@ -26,6 +38,10 @@ void Protocol::OnNetworkError(std::function<void(const std::string& message)> ca
 
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
+    if (IsOpenAbandoned()) {
+        ESP_LOGW(TAG, "Open cancelled, not reporting: %s", message.c_str());
+        return;
+    }
     if (on_network_error_ != nullptr) {
         on_network_error_(message);
     }
@@ -37,13 +53,13 @@ void Protocol::SendAbortSpeaking(AbortReason reason) {
         message += ",\"reason\":\"wake_word_detected\"";
     }
     message += "}";
-    SendText(message);
+    SendControl(message, true);
 }
 
 void Protocol::SendWakeWordDetected(const std::string& wake_word) {
     std::string json = "{\"session_id\":\"" + session_id_ + 
                       "\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"" + wake_word + "\"}";
-    SendText(json);
+    SendControl(json);
 }
 
 void Protocol::SendStartListening(ListeningMode mode) {
@@ -57,12 +73,13 @@ void Protocol::SendStartListening(ListeningMode mode) {
         message += ",\"mode\":\"manual\"";
     }
     message += "}";
-    SendText(message);
+    SendControl(message);
 }
 
 void Protocol::SendStopListening() {
+    // Audio already handed to the protocol goes before the stop, including a partly filled batch
     std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
-    SendText(message);
+    SendControl(message, false, true);
 }
 
 void Protocol::SendIotDescriptors(const std::string& descriptors) {
@@ -102,7 +119,7 @@ void Protocol::SendIotDescriptors(const std::string& descriptors) {
             continue;
         }
 
-        SendText(std::string(message));
+        SendControl(std::string(message));
         cJSON_free(message);
         cJSON_Delete(messageRoot);
     }
@@ -112,7 +129,7 @@ void Protocol::SendIotDescriptors(const std::string& descriptors) {
 
 void Protocol::SendIotStates(const std::string& states) {
     std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"iot\",\"update\":true,\"states\":" + states + "}";
-    SendText(message);
+    SendControl(message);
 }
 
 bool Protocol::IsTimeout() const {
@@ -126,3 +143,302 @@ bool Protocol::IsTimeout() const {
     return timeout;
 }
 
+void Protocol::ReportSessionTimeout(bool session_open) {
+    if (session_open && !connected_endpoint_.empty() && IsTimeout()) {
+        endpoints_.ReportFailure(connected_endpoint_);
+    }
+}
+
+
+bool Protocol::StartWarmWindow(bool transport_ok) {
+    if (CONFIG_AUDIO_CHANNEL_WARM_SECONDS <= 0 || !transport_ok || error_occurred_) {
+        return false;
+    }
+    ESP_LOGI(TAG, "Keeping the transport warm for %d seconds", CONFIG_AUDIO_CHANNEL_WARM_SECONDS);
+    warm_since_ = std::chrono::steady_clock::now();
+    last_keepalive_time_ = warm_since_;
+    warm_ = true;
+    return true;
+}
+
+void Protocol::MaintainWarmChannel() {
+    if (!warm_) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now - warm_since_ >= std::chrono::seconds(CONFIG_AUDIO_CHANNEL_WARM_SECONDS)) {
+        ESP_LOGI(TAG, "Warm window is over, closing the transport");
+        warm_ = false;
+        CloseTransport();
+        return;
+    }
+    if (now - last_keepalive_time_ >= std::chrono::seconds(PROTOCOL_KEEPALIVE_INTERVAL_SECONDS)) {
+        last_keepalive_time_ = now;
+        SendKeepAlive();
+    }
+}
+
+void Protocol::BeginOpen(bool warm) {
+    open_start_time_ = esp_timer_get_time();
+    open_warm_ = warm;
+    first_packet_pending_ = true;
+    // The timeout counts from the open, a resumed session may not hear from the server for a while
+    last_incoming_time_ = std::chrono::steady_clock::now();
+
+    // Every session negotiates batching again in its hello
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    audio_batch_frames_ = 1;
+    audio_batch_.clear();
+    audio_batch_count_ = 0;
+}
+
+void Protocol::ReportFirstPacket() {
+    if (!first_packet_pending_.exchange(false)) {
+        return;
+    }
+    uint32_t elapsed_ms = (esp_timer_get_time() - open_start_time_) / 1000;
+    int kind = open_warm_ ? 1 : 0;
+    open_count_[kind]++;
+    open_total_ms_[kind] += elapsed_ms;
+    ESP_LOGI(TAG, "%s open: first audio packet after %lu ms (avg %lu ms over %lu opens)",
+        open_warm_ ? "Warm" : "Cold", elapsed_ms, open_total_ms_[kind] / open_count_[kind], open_count_[kind]);
+}
+
+struct OpenRequest {
+    Protocol* protocol;
+    uint32_t generation;
+    std::function<void(bool opened)> callback;
+};
+
+void Protocol::OpenAudioChannelAsync(std::function<void(bool opened)> callback) {
+    if (open_mutex_ == nullptr) {
+        open_mutex_ = xSemaphoreCreateMutex();
+    }
+    opening_ = true;
+    auto request = new OpenRequest{this, ++open_generation_, std::move(callback)};
+    // TLS needs a large stack
+    BaseType_t created = xTaskCreate([](void* arg) {
+        auto request = (OpenRequest*)arg;
+        auto protocol = request->protocol;
+        uint32_t generation = request->generation;
+        xSemaphoreTake(protocol->open_mutex_, portMAX_DELAY);
+        bool opened = false;
+        if (generation == protocol->open_generation_) {
+            protocol->running_generation_ = generation;
+            protocol->open_running_ = true;
+            opened = protocol->OpenAudioChannel();
+            protocol->open_running_ = false;
+        }
+        if (generation != protocol->open_generation_) {
+            if (opened) {
+                protocol->ParkCancelledChannel();
+            }
+        } else {
+            auto callback = std::move(request->callback);
+            // The opened callback touches application state, run it on the main loop with the result
+            Application::GetInstance().Schedule([protocol, generation, callback, opened]() {
+                if (generation != protocol->open_generation_) {
+                    // Cancelled while the result was queued. A newer open that is still pending
+                    // takes the transport over, otherwise nobody will use it.
+                    if (opened && !protocol->opening_) {
+                        protocol->ParkCancelledChannel();
+                    }
+                    return;
+                }
+                protocol->opening_ = false;
+                if (opened && protocol->on_audio_channel_opened_ != nullptr) {
+                    protocol->on_audio_channel_opened_();
+                }
+                callback(opened);
+            });
+        }
+        xSemaphoreGive(protocol->open_mutex_);
+        delete request;
+        vTaskDelete(NULL);
+    }, "open_channel", 4096 * 2, request, 3, nullptr);
+
+    if (created != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the open_channel task");
+        auto callback = std::move(request->callback);
+        delete request;
+        opening_ = false;
+        SetError(Lang::Strings::SERVER_ERROR);
+        Application::GetInstance().Schedule([callback]() {
+            callback(false);
+        });
+    }
+}
+
+// Park it without the closed callback, that would knock a newer open back to idle.
+// The opened callback never ran for it, so there is no application state to undo.
+void Protocol::ParkCancelledChannel() {
+    if (!StartWarmWindow(true)) {
+        ESP_LOGI(TAG, "Channel opened after the request was cancelled, closing it");
+        CloseTransport();
+    }
+}
+
+void Protocol::CancelOpenAudioChannel() {
+    if (!opening_) {
+        return;
+    }
+    ESP_LOGI(TAG, "Cancel opening the audio channel");
+    opening_ = false;
+    open_generation_++;
+}
+
+bool Protocol::WaitForServerHello(EventGroupHandle_t event_group, EventBits_t bit, int timeout_ms) {
+    const int kSliceMs = 100;
+    for (int waited = 0; waited < timeout_ms && !IsOpenAbandoned(); waited += kSliceMs) {
+        if (xEventGroupWaitBits(event_group, bit, pdTRUE, pdFALSE, pdMS_TO_TICKS(kSliceMs)) & bit) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Protocol::HasControl() {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    return !control_lane_.empty();
+}
+
+// Called with write_mutex_ held
+void Protocol::DrainControlLane() {
+    while (true) {
+        ControlMessage message;
+        {
+            std::lock_guard<std::mutex> lock(control_mutex_);
+            if (control_lane_.empty()) {
+                return;
+            }
+            message = std::move(control_lane_.front());
+            control_lane_.pop_front();
+        }
+        if (message.flush_audio && audio_batch_count_ > 0) {
+            WriteAudioCounted(audio_batch_, audio_batch_count_);
+            audio_batch_.clear();
+            audio_batch_count_ = 0;
+        }
+        SendText(message.text);
+        if (message.abort) {
+            int64_t now = esp_timer_get_time();
+            abort_written_time_ = now;
+            ESP_LOGI(TAG, "Abort written %lld ms after it was queued", (now - message.queued_time) / 1000);
+        }
+    }
+}
+
+// Whoever holds the write lock flushes the lane after releasing it, so a message
+// queued while the lock was busy is never left behind
+void Protocol::FlushControlLane() {
+    while (HasControl()) {
+        std::unique_lock<std::mutex> lock(write_mutex_, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            return;
+        }
+        DrainControlLane();
+    }
+}
+
+void Protocol::SendControl(const std::string& message, bool abort, bool flush_audio) {
+    {
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        control_lane_.push_back({esp_timer_get_time(), message, abort, flush_audio});
+    }
+    FlushControlLane();
+}
+
+void Protocol::DrainControlLaneBeforeClose() {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    DrainControlLane();
+}
+
+void Protocol::SendAudio(const std::vector<uint8_t>& data, uint32_t queue_delay_ms) {
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if (HasControl()) {
+            // Control waited behind the last audio write, the link is behind
+            DrainControlLane();
+            audio_congested_ = true;
+        }
+        if (audio_congested_ && queue_delay_ms > PROTOCOL_STALE_AUDIO_MS) {
+            stale_audio_dropped_++;
+        } else {
+            if (audio_congested_) {
+                audio_congested_ = false;
+                if (stale_audio_dropped_ > 0) {
+                    ESP_LOGW(TAG, "Dropped %lu stale audio packets behind control messages", stale_audio_dropped_);
+                    stale_audio_dropped_ = 0;
+                }
+            }
+            if (audio_batch_frames_ <= 1) {
+                WriteAudioCounted(data, 1);
+            } else {
+                size_t offset = audio_batch_.size();
+                audio_batch_.resize(offset + sizeof(BinaryProtocol3) + data.size());
+                auto frame = (BinaryProtocol3*)&audio_batch_[offset];
+                frame->type = 0;
+                frame->reserved = 0;
+                frame->payload_size = htons(data.size());
+                memcpy(frame->payload, data.data(), data.size());
+                // The profile may lengthen the frames after the hello, keep the batch within the budget
+                if (++audio_batch_count_ >= std::min(audio_batch_frames_, MaxAudioBatchFrames())) {
+                    WriteAudioCounted(audio_batch_, audio_batch_count_);
+                    audio_batch_.clear();
+                    audio_batch_count_ = 0;
+                }
+            }
+        }
+    }
+    FlushControlLane();
+}
+
+void Protocol::FlushAudio() {
+    {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if (audio_batch_count_ > 0) {
+            WriteAudioCounted(audio_batch_, audio_batch_count_);
+            audio_batch_.clear();
+            audio_batch_count_ = 0;
+        }
+    }
+    FlushControlLane();
+}
+
+bool Protocol::HasPendingAudio() {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    return audio_batch_count_ > 0;
+}
+
+void Protocol::WriteAudioCounted(const std::vector<uint8_t>& data, int packets) {
+    WriteAudio(data);
+    audio_writes_++;
+    audio_packets_ += packets;
+    audio_wire_bytes_ += data.size() + audio_write_overhead();
+}
+
+Protocol::AudioWriteStats Protocol::GetAudioWriteStats() const {
+    return {audio_writes_.load(), audio_packets_.load(), audio_wire_bytes_.load()};
+}
+
+int Protocol::MaxAudioBatchFrames() const {
+    // The first packet of a batch waits for the ones after it
+    int frames = CONFIG_UPLINK_BATCH_MAX_DELAY_MS / uplink_frame_duration_ + 1;
+    return std::min(frames, PROTOCOL_AUDIO_BATCH_MAX_FRAMES);
+}
+
+std::string Protocol::AudioBatchHelloParams() const {
+    int frames = MaxAudioBatchFrames();
+    return frames > 1 ? ", \"batch_frames\":" + std::to_string(frames) : std::string();
+}
+
+void Protocol::ParseAudioBatch(const cJSON* audio_params) {
+    // Servers that do not know batching leave it out and get one packet per write
+    auto batch_frames = cJSON_GetObjectItem(audio_params, "batch_frames");
+    int frames = cJSON_IsNumber(batch_frames) ? std::clamp(batch_frames->valueint, 1, MaxAudioBatchFrames()) : 1;
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (frames != audio_batch_frames_) {
+        ESP_LOGI(TAG, "Uplink batching: %d packets per write", frames);
+    }
+    audio_batch_frames_ = frames;
+}
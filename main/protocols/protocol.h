@@ -2,9 +2,27 @@
 #define PROTOCOL_H
 
 #include <cJSON.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/semphr.h>
 #include <string>
 #include <functional>
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <cstdint>
+
+#include "endpoint_selector.h"
+
+// Keepalive interval for a transport kept warm between sessions
+#define PROTOCOL_KEEPALIVE_INTERVAL_SECONDS 15
+
+// Audio queued longer than this is dropped after control messages had to wait for the link
+#define PROTOCOL_STALE_AUDIO_MS 300
+
+// Upper bound for the Opus packets packed into one transport write
+#define PROTOCOL_AUDIO_BATCH_MAX_FRAMES 8
 
 struct BinaryProtocol3 {
     uint8_t type;
@@ -37,18 +55,48 @@ public:
     inline const std::string& session_id() const {
         return session_id_;
     }
+    // Frame duration advertised for the uplink in the next hello
+    inline int uplink_frame_duration() const {
+        return uplink_frame_duration_;
+    }
+    inline void SetUplinkFrameDuration(int duration_ms) {
+        uplink_frame_duration_ = duration_ms;
+    }
 
-    void OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data)> callback);
+    // sequence is the transport sequence number of the packet, increasing by one per frame
+    void OnIncomingAudio(std::function<void(std::vector<uint8_t>&& data, uint32_t sequence)> callback);
     void OnIncomingJson(std::function<void(const cJSON* root)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
 
     virtual void Start() = 0;
+    // Reuses a warm transport when there is one, then only the hello is exchanged
+    // Runs on the open task. The opened callback follows on the main loop, see OpenAudioChannelAsync.
     virtual bool OpenAudioChannel() = 0;
+    // Ends the session, the transport stays warm for CONFIG_AUDIO_CHANNEL_WARM_SECONDS when enabled
     virtual void CloseAudioChannel() = 0;
+    // Runs OpenAudioChannel on a worker task so the main loop keeps running, the callback is
+    // scheduled on the main loop with the result. Opens are serialized, a new one waits for the last.
+    void OpenAudioChannelAsync(std::function<void(bool opened)> callback);
+    // Abandons the open in progress: its callback is never called and errors are not reported.
+    // A channel that still comes up is kept warm for the next open, or closed.
+    void CancelOpenAudioChannel();
+    bool IsOpening() const { return opening_; }
     virtual bool IsAudioChannelOpened() const = 0;
-    virtual void SendAudio(const std::vector<uint8_t>& data) = 0;
+    // Audio lane. queue_delay_ms is how long the packet waited before this call. Control
+    // messages waiting for the link go out first, and stale audio is dropped behind them.
+    void SendAudio(const std::vector<uint8_t>& data, uint32_t queue_delay_ms = 0);
+    // Writes a partly filled audio batch, call when no packet followed within a frame duration
+    void FlushAudio();
+    bool HasPendingAudio();
+
+    struct AudioWriteStats {
+        uint32_t writes;
+        uint32_t packets;
+        uint32_t wire_bytes; // payload plus the estimated per write transport overhead
+    };
+    AudioWriteStats GetAudioWriteStats() const;
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
@@ -56,22 +104,127 @@ public:
     virtual void SendIotDescriptors(const std::string& descriptors);
     virtual void SendIotStates(const std::string& states);
 
+    // Hint that an open is likely soon, a transport may start connecting. Must not block.
+    virtual void Preconnect() {}
+
+    // Measures the configured servers in the background, the next connection uses the fastest
+    void ProbeEndpoints() { endpoints_.ProbeAsync(); }
+    // Hosts of every configured server, including the fallbacks
+    std::vector<std::string> endpoint_hosts() { return endpoints_.Hosts(); }
+
+    // Transport carrying the audio of the current session
+    virtual const char* audio_path() const { return "websocket"; }
+
+    // True while the transport is kept up between sessions
+    bool IsWarm() const { return warm_; }
+    // Call once a second from the main task: pings a warm transport and closes it when the window is over
+    void MaintainWarmChannel();
+
 protected:
     std::function<void(const cJSON* root)> on_incoming_json_;
-    std::function<void(std::vector<uint8_t>&& data)> on_incoming_audio_;
+    std::function<void(std::vector<uint8_t>&& data, uint32_t sequence)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
     std::function<void(const std::string& message)> on_network_error_;
 
     int server_sample_rate_ = 24000;
     int server_frame_duration_ = 60;
+    // Set from the main loop when the uplink profile changes, read by the send task
+    std::atomic<int> uplink_frame_duration_{60};
     bool error_occurred_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
 
+    std::atomic<bool> warm_{false};
+
+    EndpointSelector endpoints_;
+    // The endpoint of the current connection
+    std::string connected_endpoint_;
+
+    // Every request and cancel bumps open_generation_, the worker inside OpenAudioChannel
+    // records the generation it serves, a mismatch means nobody waits for that open any more
+    SemaphoreHandle_t open_mutex_ = nullptr;
+    std::atomic<uint32_t> open_generation_{0};
+    std::atomic<uint32_t> running_generation_{0};
+    std::atomic<bool> open_running_{false};
+    std::atomic<bool> opening_{false};
+
+    bool IsOpenAbandoned() const { return open_running_ && running_generation_ != open_generation_; }
+    void ParkCancelledChannel();
+    std::chrono::time_point<std::chrono::steady_clock> warm_since_;
+    std::chrono::time_point<std::chrono::steady_clock> last_keepalive_time_;
+
+    // Connect-to-first-packet time, kept separately for cold and warm opens
+    int64_t open_start_time_ = 0;
+    bool open_warm_ = false;
+    std::atomic<bool> first_packet_pending_{false};
+    uint32_t open_count_[2] = {0, 0};
+    uint32_t open_total_ms_[2] = {0, 0};
+
+    // Packets per audio write agreed in the hello, 1 sends every packet on its own.
+    // Batched writes carry BinaryProtocol3 sub-frames: type 0, reserved, big endian size, Opus.
+    int audio_batch_frames_ = 1;
+    // Largest batch CONFIG_UPLINK_BATCH_MAX_DELAY_MS allows at the current uplink frame duration
+    int MaxAudioBatchFrames() const;
+    // Hello fields offering the batch size, empty when batching is off
+    std::string AudioBatchHelloParams() const;
+    void ParseAudioBatch(const cJSON* audio_params);
+    // Transport bytes on top of the payload of one audio write
+    virtual int audio_write_overhead() const { return 0; }
+
+    // Raw writes to the transport, the lanes above decide the order
     virtual bool SendText(const std::string& text) = 0;
+    virtual void WriteAudio(const std::vector<uint8_t>& data) = 0;
+    // Control lane: written ahead of any audio not yet on the transport. With flush_audio the
+    // partly filled batch is written first, without making the caller wait for the write lock.
+    void SendControl(const std::string& message, bool abort = false, bool flush_audio = false);
+    // Writes whatever is left on the control lane, waiting for an audio write in progress.
+    // Close paths call it before tearing down the transport the lane writes to.
+    void DrainControlLaneBeforeClose();
+    virtual void SendKeepAlive() {}
+    // Tears down the transport kept warm after a session
+    virtual void CloseTransport() = 0;
+    // Waits for the server hello in short slices, returns early when the open is cancelled
+    bool WaitForServerHello(EventGroupHandle_t event_group, EventBits_t bit, int timeout_ms);
+    // Returns false when warm channels are disabled or the transport is unusable
+    bool StartWarmWindow(bool transport_ok);
+    void BeginOpen(bool warm);
+    // Call from WriteAudio, logs the time from the open to the first uplink packet once per open
+    void ReportFirstPacket();
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+    // Call at the start of an open with whether the last session was still up: a session that
+    // went silent counts against its endpoint, an idle transport does not
+    void ReportSessionTimeout(bool session_open);
+
+private:
+    struct ControlMessage {
+        int64_t queued_time;
+        std::string text;
+        bool abort;
+        bool flush_audio;
+    };
+    // Held for every transport write issued through the lanes
+    std::mutex write_mutex_;
+    std::mutex control_mutex_;
+    std::deque<ControlMessage> control_lane_;
+    bool audio_congested_ = false;
+    uint32_t stale_audio_dropped_ = 0;
+    // Abort latency: queue to transport, and transport to the first server message
+    std::atomic<int64_t> abort_written_time_{0};
+
+    std::vector<uint8_t> audio_batch_;
+    int audio_batch_count_ = 0;
+    std::atomic<uint32_t> audio_writes_{0};
+    std::atomic<uint32_t> audio_packets_{0};
+    std::atomic<uint32_t> audio_wire_bytes_{0};
+
+    // Called with write_mutex_ held
+    void WriteAudioCounted(const std::vector<uint8_t>& data, int packets);
+
+    bool HasControl();
+    void DrainControlLane();
+    void FlushControlLane();
 };
 
 #endif // PROTOCOL_H
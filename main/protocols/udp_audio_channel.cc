@@ -0,0 +1,62 @@
+#include "udp_audio_channel.h"
+#include "board.h"
+
+#include <esp_log.h>
+
+#define TAG "UdpAudio"
+
+UdpAudioChannel::~UdpAudioChannel() {
+    Close();
+}
+
+bool UdpAudioChannel::Open(const std::string& server, int port, const std::string& key, const std::string& nonce,
+    std::function<void(std::vector<uint8_t>&& data, uint32_t sequence)> on_packet) {
+    Close();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!cipher_.SetKey(key, nonce)) {
+        ESP_LOGE(TAG, "Invalid key or nonce");
+        return false;
+    }
+    local_sequence_ = 0;
+
+    udp_ = Board::GetInstance().CreateUdp();
+    udp_->OnMessage([this, on_packet](const std::string& data) {
+        std::vector<uint8_t> payload;
+        uint32_t sequence;
+        if (!cipher_.Open(data, payload, sequence)) {
+            ESP_LOGD(TAG, "Invalid packet, size %u", data.size());
+            return;
+        }
+        on_packet(std::move(payload), sequence);
+    });
+    udp_->Connect(server, port);
+    ESP_LOGI(TAG, "UDP audio channel to %s:%d", server.c_str(), port);
+    return true;
+}
+
+void UdpAudioChannel::Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (udp_ != nullptr) {
+        delete udp_;
+        udp_ = nullptr;
+    }
+}
+
+bool UdpAudioChannel::IsOpen() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return udp_ != nullptr;
+}
+
+bool UdpAudioChannel::Send(const std::vector<uint8_t>& data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (udp_ == nullptr) {
+        return false;
+    }
+    std::string packet;
+    if (!cipher_.Seal(data, ++local_sequence_, packet)) {
+        ESP_LOGE(TAG, "Failed to encrypt audio data");
+        return false;
+    }
+    udp_->Send(packet);
+    return true;
+}
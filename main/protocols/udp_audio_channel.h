@@ -0,0 +1,35 @@
+#ifndef UDP_AUDIO_CHANNEL_H
+#define UDP_AUDIO_CHANNEL_H
+
+#include "udp_audio_packet.h"
+
+#include <udp.h>
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+
+// AES-CTR encrypted Opus over UDP in the packet format of the MQTT audio channel,
+// see UdpAudioCipher. A packet with an empty payload is a probe.
+class UdpAudioChannel {
+public:
+    UdpAudioChannel() = default;
+    ~UdpAudioChannel();
+
+    // key and nonce are the hex strings of the server hello
+    bool Open(const std::string& server, int port, const std::string& key, const std::string& nonce,
+        std::function<void(std::vector<uint8_t>&& data, uint32_t sequence)> on_packet);
+    void Close();
+    bool IsOpen();
+    bool Send(const std::vector<uint8_t>& data);
+
+private:
+    std::mutex mutex_;
+    Udp* udp_ = nullptr;
+    UdpAudioCipher cipher_;
+    uint32_t local_sequence_ = 0;
+};
+
+#endif // UDP_AUDIO_CHANNEL_H
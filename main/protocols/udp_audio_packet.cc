@@ -0,0 +1,77 @@
+#include "udp_audio_packet.h"
+
+#include <arpa/inet.h>
+#include <cstring>
+
+UdpAudioCipher::UdpAudioCipher() {
+    mbedtls_aes_init(&aes_ctx_);
+}
+
+UdpAudioCipher::~UdpAudioCipher() {
+    mbedtls_aes_free(&aes_ctx_);
+}
+
+static int HexNibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+std::string UdpAudioCipher::DecodeHexString(const std::string& hex_string) {
+    std::string decoded;
+    if (hex_string.size() % 2 != 0) {
+        return decoded;
+    }
+    decoded.reserve(hex_string.size() / 2);
+    for (size_t i = 0; i < hex_string.size(); i += 2) {
+        int high = HexNibble(hex_string[i]);
+        int low = HexNibble(hex_string[i + 1]);
+        if (high < 0 || low < 0) {
+            return std::string();
+        }
+        decoded.push_back((char)((high << 4) | low));
+    }
+    return decoded;
+}
+
+bool UdpAudioCipher::SetKey(const std::string& key, const std::string& nonce) {
+    auto key_bytes = DecodeHexString(key);
+    auto nonce_bytes = DecodeHexString(nonce);
+    if (key_bytes.size() != 16 || nonce_bytes.size() != 16) {
+        return false;
+    }
+    nonce_ = nonce_bytes;
+    return mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)key_bytes.data(), 128) == 0;
+}
+
+bool UdpAudioCipher::Seal(const std::vector<uint8_t>& payload, uint32_t sequence, std::string& packet) {
+    if (nonce_.size() != 16 || payload.size() > UINT16_MAX) {
+        return false;
+    }
+    uint8_t nonce[16];
+    memcpy(nonce, nonce_.data(), sizeof(nonce));
+    *(uint16_t*)&nonce[2] = htons(payload.size());
+    *(uint32_t*)&nonce[12] = htonl(sequence);
+
+    packet.resize(sizeof(nonce) + payload.size());
+    memcpy(&packet[0], nonce, sizeof(nonce));
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    return mbedtls_aes_crypt_ctr(&aes_ctx_, payload.size(), &nc_off, nonce, stream_block,
+        payload.data(), (uint8_t*)&packet[sizeof(nonce)]) == 0;
+}
+
+bool UdpAudioCipher::Open(const std::string& packet, std::vector<uint8_t>& payload, uint32_t& sequence) {
+    if (nonce_.size() != 16 || packet.size() < 16 || packet[0] != 0x01) {
+        return false;
+    }
+    uint8_t nonce[16];
+    memcpy(nonce, packet.data(), sizeof(nonce));
+    sequence = ntohl(*(uint32_t*)&nonce[12]);
+    payload.resize(packet.size() - sizeof(nonce));
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    return mbedtls_aes_crypt_ctr(&aes_ctx_, payload.size(), &nc_off, nonce, stream_block,
+        (const uint8_t*)packet.data() + sizeof(nonce), payload.data()) == 0;
+}
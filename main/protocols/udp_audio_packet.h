@@ -0,0 +1,36 @@
+#ifndef UDP_AUDIO_PACKET_H
+#define UDP_AUDIO_PACKET_H
+
+#include <mbedtls/aes.h>
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Packet format of the UDP audio channel, shared with the MQTT audio channel:
+// a 16 byte nonce (type 0x01, reserved, big endian payload size, 8 server bytes, big endian
+// sequence) then the payload, AES-128-CTR encrypted with the whole nonce as the initial counter.
+// Kept free of transport and logging so it also builds on the host.
+class UdpAudioCipher {
+public:
+    UdpAudioCipher();
+    ~UdpAudioCipher();
+    UdpAudioCipher(const UdpAudioCipher&) = delete;
+    UdpAudioCipher& operator=(const UdpAudioCipher&) = delete;
+
+    // key and nonce are the hex strings of the server hello, false unless both are 16 bytes
+    bool SetKey(const std::string& key, const std::string& nonce);
+    // An empty payload makes a probe
+    bool Seal(const std::vector<uint8_t>& payload, uint32_t sequence, std::string& packet);
+    // False for packets too short or of another type
+    bool Open(const std::string& packet, std::vector<uint8_t>& payload, uint32_t& sequence);
+
+    // Empty on an odd length or a character that is not hex
+    static std::string DecodeHexString(const std::string& hex_string);
+
+private:
+    mbedtls_aes_context aes_ctx_;
+    std::string nonce_;
+};
+
+#endif // UDP_AUDIO_PACKET_H
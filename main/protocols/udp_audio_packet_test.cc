@@ -0,0 +1,163 @@
+// Host loopback check of the UDP audio packet format, not part of the firmware build.
+// A stand-in server on 127.0.0.1 implements the server side from docs/websocket.md with
+// OpenSSL's AES-128-CTR, the device side is UdpAudioCipher. Checks the probe exchange,
+// audio both ways and the sequence numbers.
+//
+//   g++ -std=c++17 -I main/protocols/host_shims -o /tmp/udp_audio_packet_test
+//       main/protocols/udp_audio_packet.cc main/protocols/udp_audio_packet_test.cc -lcrypto -lpthread
+//   /tmp/udp_audio_packet_test
+
+#include "udp_audio_packet.h"
+
+#include <openssl/evp.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define KEY_HEX "00112233445566778899aabbccddeeff"
+// Type 0x01, reserved, size and sequence are zero, the middle 8 bytes identify the session
+#define NONCE_HEX "01000000a1b2c3d4e5f6a7b800000000"
+
+static int failures = 0;
+
+static void Expect(bool condition, const char* what) {
+    if (!condition) {
+        printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+static std::vector<uint8_t> Ctr(const uint8_t* iv, const uint8_t* data, size_t size) {
+    auto key = UdpAudioCipher::DecodeHexString(KEY_HEX);
+    std::vector<uint8_t> out(size + 16);
+    int length = 0;
+    auto ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), nullptr, (const uint8_t*)key.data(), iv);
+    EVP_EncryptUpdate(ctx, out.data(), &length, data, size);
+    EVP_CIPHER_CTX_free(ctx);
+    out.resize(length);
+    return out;
+}
+
+// Stand-in server: answers a probe with a probe and echoes audio back under its own sequence
+static void Server(int fd, std::atomic<int>& client_packets, uint32_t& last_client_sequence) {
+    auto session = UdpAudioCipher::DecodeHexString(NONCE_HEX);
+    uint32_t server_sequence = 1000;
+    uint8_t buffer[2048];
+    while (true) {
+        sockaddr_in peer = {};
+        socklen_t peer_length = sizeof(peer);
+        ssize_t received = recvfrom(fd, buffer, sizeof(buffer), 0, (sockaddr*)&peer, &peer_length);
+        if (received < 0) {
+            return;
+        }
+        if (received == 1 && buffer[0] == 0xFF) {
+            return;
+        }
+        Expect(received >= 16, "server: packet shorter than the nonce");
+        Expect(buffer[0] == 0x01, "server: packet type");
+        Expect(memcmp(buffer + 4, session.data() + 4, 8) == 0, "server: session bytes of the nonce");
+        uint16_t size = ntohs(*(uint16_t*)&buffer[2]);
+        Expect(size == received - 16, "server: size field");
+        uint32_t sequence = ntohl(*(uint32_t*)&buffer[12]);
+        Expect(sequence == last_client_sequence + 1, "server: client sequence increments by one");
+        last_client_sequence = sequence;
+        client_packets++;
+
+        auto payload = Ctr(buffer, buffer + 16, received - 16);
+        uint8_t nonce[16];
+        memcpy(nonce, session.data(), 16);
+        *(uint16_t*)&nonce[2] = htons(payload.size());
+        *(uint32_t*)&nonce[12] = htonl(++server_sequence);
+        auto encrypted = Ctr(nonce, payload.data(), payload.size());
+        std::vector<uint8_t> reply(nonce, nonce + 16);
+        reply.insert(reply.end(), encrypted.begin(), encrypted.end());
+        sendto(fd, reply.data(), reply.size(), 0, (sockaddr*)&peer, peer_length);
+    }
+}
+
+static bool Receive(int fd, std::string& packet) {
+    char buffer[2048];
+    ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+    if (received < 0) {
+        return false;
+    }
+    packet.assign(buffer, received);
+    return true;
+}
+
+int main() {
+    int server_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(server_fd, (sockaddr*)&address, sizeof(address));
+    socklen_t address_length = sizeof(address);
+    getsockname(server_fd, (sockaddr*)&address, &address_length);
+
+    std::atomic<int> client_packets{0};
+    uint32_t last_client_sequence = 0;
+    std::thread server(Server, server_fd, std::ref(client_packets), std::ref(last_client_sequence));
+
+    int client_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    timeval timeout = {2, 0};
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    connect(client_fd, (sockaddr*)&address, sizeof(address));
+
+    UdpAudioCipher cipher;
+    Expect(!cipher.SetKey(KEY_HEX, "0102"), "short nonce is refused");
+    Expect(!cipher.SetKey("zz112233445566778899aabbccddeeff", NONCE_HEX), "key that is not hex is refused");
+    Expect(cipher.SetKey(KEY_HEX, NONCE_HEX), "key and nonce from the hello");
+
+    // Probe first, as WebsocketProtocol::StartUdpAudio does
+    uint32_t local_sequence = 0;
+    uint32_t remote_sequence = 1000;
+    std::string packet;
+    std::vector<uint8_t> payload;
+    uint32_t sequence = 0;
+    Expect(cipher.Seal({}, ++local_sequence, packet) && packet.size() == 16, "probe is a bare nonce");
+    send(client_fd, packet.data(), packet.size(), 0);
+    Expect(Receive(client_fd, packet), "server answers the probe");
+    Expect(cipher.Open(packet, payload, sequence) && payload.empty(), "probe answer is empty");
+    Expect(sequence == ++remote_sequence, "probe answer sequence");
+
+    // Sizes around the 16 byte counter block, and a large Opus packet
+    for (size_t size : {1, 15, 16, 17, 33, 120, 1200}) {
+        std::vector<uint8_t> audio(size);
+        for (size_t i = 0; i < size; i++) {
+            audio[i] = (uint8_t)(i * 7 + size);
+        }
+        Expect(cipher.Seal(audio, ++local_sequence, packet), "seal audio");
+        Expect(memcmp(packet.data() + 16, audio.data(), std::min<size_t>(size, 4)) != 0 || size < 4, "payload is encrypted");
+        send(client_fd, packet.data(), packet.size(), 0);
+        Expect(Receive(client_fd, packet), "server echoes audio");
+        Expect(cipher.Open(packet, payload, sequence), "open the echo");
+        Expect(payload == audio, "echoed audio matches");
+        Expect(sequence == ++remote_sequence, "echo sequence");
+    }
+
+    std::string bad = packet;
+    bad[0] = 0x02;
+    Expect(!cipher.Open(bad, payload, sequence), "other packet types are refused");
+    Expect(!cipher.Open(packet.substr(0, 15), payload, sequence), "packets shorter than the nonce are refused");
+
+    const char stop = (char)0xFF;
+    send(client_fd, &stop, 1, 0);
+    server.join();
+    close(client_fd);
+    close(server_fd);
+
+    Expect(client_packets == (int)local_sequence, "server saw every client packet");
+    printf("%s: %d packets each way\n", failures == 0 ? "UDP audio loopback passed" : "UDP audio loopback failed",
+        client_packets.load());
+    return failures == 0 ? 0 : 1;
+}
@@ -2,8 +2,11 @@
 #include "board.h"
 #include "system_info.h"
 #include "application.h"
+#include "dns_cache.h"
+#include "settings.h"
 
 #include <cstring>
+#include <algorithm>
 #include <cJSON.h>
 #include <esp_log.h>
 #include <arpa/inet.h>
@@ -13,9 +16,47 @@
 
 WebsocketProtocol::WebsocketProtocol() {
     event_group_handle_ = xEventGroupCreate();
+
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    esp_timer_create_args_t probe_timer_args = {
+        .callback = [](void* arg) {
+            auto protocol = (WebsocketProtocol*)arg;
+            if (protocol->udp_active_) {
+                esp_timer_stop(protocol->udp_probe_timer_);
+                return;
+            }
+            int64_t probe_start = protocol->udp_probe_start_;
+            if (esp_timer_get_time() - probe_start >= WEBSOCKET_UDP_PROBE_TIMEOUT_MS * 1000LL) {
+                // Closing the socket and the websocket write must not run on the shared timer task
+                esp_timer_stop(protocol->udp_probe_timer_);
+                Application::GetInstance().Schedule([protocol, probe_start]() {
+                    // An answer came late, the session closed, or a newer one started probing
+                    if (protocol->udp_active_ || !protocol->udp_channel_.IsOpen() || protocol->udp_probe_start_ != probe_start) {
+                        return;
+                    }
+                    ESP_LOGW(TAG, "No answer over UDP, audio stays in the websocket");
+                    protocol->StopUdpAudio();
+                    protocol->ReportAudioPath();
+                });
+                return;
+            }
+            protocol->udp_channel_.Send(std::vector<uint8_t>());
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "udp_probe",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&probe_timer_args, &udp_probe_timer_);
+#endif
 }
 
 WebsocketProtocol::~WebsocketProtocol() {
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    esp_timer_stop(udp_probe_timer_);
+    esp_timer_delete(udp_probe_timer_);
+    udp_channel_.Close();
+#endif
     if (websocket_ != nullptr) {
         delete websocket_;
     }
@@ -23,17 +64,53 @@ WebsocketProtocol::~WebsocketProtocol() {
 }
 
 void WebsocketProtocol::Start() {
+    // Servers from the OTA response come first, then the configured ones. The board picks
+    // the transport from CONFIG_WEBSOCKET_URL, so every URL must share its scheme.
+    Settings settings("websocket", false);
+    auto urls = EndpointSelector::SplitList(settings.GetString("urls"));
+    auto configured = EndpointSelector::SplitList(CONFIG_WEBSOCKET_URL " " CONFIG_WEBSOCKET_FALLBACK_URLS);
+    urls.insert(urls.end(), configured.begin(), configured.end());
+    std::string primary = CONFIG_WEBSOCKET_URL;
+    std::string scheme = primary.substr(0, primary.find("://"));
+    for (auto& url : urls) {
+        std::string host;
+        int port;
+        if (url.compare(0, scheme.size() + 3, scheme + "://") != 0 || !DnsCache::ParseUrl(url, host, port)) {
+            ESP_LOGW(TAG, "Ignoring websocket URL %s", url.c_str());
+            continue;
+        }
+        endpoints_.Add(url, host, port);
+    }
 }
 
-void WebsocketProtocol::SendAudio(const std::vector<uint8_t>& data) {
+void WebsocketProtocol::WriteAudio(const std::vector<uint8_t>& data) {
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    if (udp_active_ && udp_channel_.Send(data)) {
+        ReportFirstPacket();
+        return;
+    }
+#endif
+    std::lock_guard<std::mutex> lock(channel_mutex_);
     if (websocket_ == nullptr) {
         return;
     }
 
     websocket_->Send(data.data(), data.size(), true);
+    ReportFirstPacket();
+}
+
+int WebsocketProtocol::audio_write_overhead() const {
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    if (udp_active_) {
+        return 16 + 28;
+    }
+#endif
+    // Binary frame header with mask, TLS 1.2 AES-GCM record, TCP and IP headers
+    return 8 + 29 + 40;
 }
 
 bool WebsocketProtocol::SendText(const std::string& text) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
     if (websocket_ == nullptr) {
         return false;
     }
@@ -48,34 +125,149 @@ bool WebsocketProtocol::SendText(const std::string& text) {
 }
 
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+    return IsSocketConnected() && !warm_ && !error_occurred_ && !IsTimeout();
+}
+
+bool WebsocketProtocol::HasSocket() const {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    return websocket_ != nullptr;
+}
+
+bool WebsocketProtocol::IsSocketConnected() const {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    return websocket_ != nullptr && websocket_->IsConnected();
 }
 
 void WebsocketProtocol::CloseAudioChannel() {
-    if (websocket_ != nullptr) {
-        delete websocket_;
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    // Every session negotiates its own side channel in the hello
+    StopUdpAudio();
+#endif
+    // Only servers that advertised re-hello get the socket kept, others would leave the
+    // next open waiting for a hello reply that never comes
+    if (StartWarmWindow(server_rehello_ && IsSocketConnected())) {
+        // The socket stays up, only the session ends. Tell the server, as MQTT does,
+        // the next session starts with a new hello on this socket.
+        std::string message = "{";
+        message += "\"session_id\":\"" + session_id_ + "\",";
+        message += "\"type\":\"goodbye\"";
+        message += "}";
+        SendControl(message);
+        if (on_audio_channel_closed_ != nullptr) {
+            on_audio_channel_closed_();
+        }
+        return;
+    }
+    CloseTransport();
+}
+
+void WebsocketProtocol::CloseTransport() {
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    StopUdpAudio();
+#endif
+    // A stop or goodbye queued behind the last audio write still goes out on this socket
+    DrainControlLaneBeforeClose();
+    WebSocket* websocket;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        websocket = websocket_;
         websocket_ = nullptr;
     }
+    // Closing may block on the network, readers only wait for the swap above
+    delete websocket;
+}
+
+void WebsocketProtocol::Preconnect() {
+    // A warm socket is already better than a new connection
+    if (warm_ || IsOpening() || IsAudioChannelOpened() || std::string(CONFIG_WEBSOCKET_URL).find("wss://") != 0) {
+        return;
+    }
+    std::string host;
+    int port;
+    if (DnsCache::ParseUrl(endpoints_.Current(), host, port)) {
+        Board::GetInstance().Preconnect(host, port);
+    }
+}
+
+void WebsocketProtocol::SendKeepAlive() {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (websocket_ != nullptr && websocket_->IsConnected()) {
+        websocket_->Ping();
+    }
 }
 
 bool WebsocketProtocol::OpenAudioChannel() {
-    if (websocket_ != nullptr) {
-        delete websocket_;
+    ReportSessionTimeout(HasSocket() && !warm_);
+    if (warm_.exchange(false) && IsSocketConnected() && !error_occurred_) {
+        // Warm open: the TLS session is still up, a new hello starts the next session
+        BeginOpen(true);
+        ResetRemoteSequence();
+        if (ExchangeHello(true)) {
+            return true;
+        }
+        ESP_LOGW(TAG, "Warm open failed, reconnecting");
     }
 
+    CloseTransport();
+    BeginOpen(false);
     error_occurred_ = false;
-    std::string url = CONFIG_WEBSOCKET_URL;
+    ResetRemoteSequence();
+
+    // Fail over through the list within this open, the fastest healthy server first
+    size_t attempts = std::max<size_t>(endpoints_.size(), 1);
+    std::string url;
+    for (size_t attempt = 0; ; attempt++) {
+        url = endpoints_.Current();
+        if (ConnectWebsocket(url)) {
+            break;
+        }
+        ESP_LOGE(TAG, "Failed to connect to websocket server %s", url.c_str());
+        endpoints_.ReportFailure(url);
+        CloseTransport();
+        if (attempt + 1 >= attempts || IsOpenAbandoned()) {
+            SetError(Lang::Strings::SERVER_NOT_FOUND);
+            return false;
+        }
+    }
+    connected_endpoint_ = url;
+
+    if (!ExchangeHello(false)) {
+        if (!IsOpenAbandoned()) {
+            endpoints_.ReportFailure(url);
+        }
+        return false;
+    }
+    endpoints_.ReportSuccess(url);
+    return true;
+}
+
+void WebsocketProtocol::ResetRemoteSequence() {
+    std::lock_guard<std::mutex> lock(sequence_mutex_);
+    remote_sequence_ = 0;
+}
+
+bool WebsocketProtocol::ConnectWebsocket(const std::string& url) {
     std::string token = "Bearer " + std::string(CONFIG_WEBSOCKET_ACCESS_TOKEN);
-    websocket_ = Board::GetInstance().CreateWebSocket();
-    websocket_->SetHeader("Authorization", token.c_str());
-    websocket_->SetHeader("Protocol-Version", "1");
-    websocket_->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
-    websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
+    auto websocket = Board::GetInstance().CreateWebSocket();
+    websocket->SetHeader("Authorization", token.c_str());
+    websocket->SetHeader("Protocol-Version", "1");
+    websocket->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
+    websocket->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
 
-    websocket_->OnData([this](const char* data, size_t len, bool binary) {
+    websocket->OnData([this](const char* data, size_t len, bool binary) {
+        last_incoming_time_ = std::chrono::steady_clock::now();
+        // Between sessions only the next server hello matters
+        if (warm_) {
+            return;
+        }
         if (binary) {
+            uint32_t sequence;
+            {
+                std::lock_guard<std::mutex> lock(sequence_mutex_);
+                sequence = ++remote_sequence_;
+            }
             if (on_incoming_audio_ != nullptr) {
-                on_incoming_audio_(std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len));
+                on_incoming_audio_(std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len), sequence);
             }
         } else {
             // Parse JSON data
@@ -94,50 +286,136 @@ bool WebsocketProtocol::OpenAudioChannel() {
             }
             cJSON_Delete(root);
         }
-        last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
-    websocket_->OnDisconnected([this]() {
+    websocket->OnDisconnected([this]() {
         ESP_LOGI(TAG, "Websocket disconnected");
+        warm_ = false;
         if (on_audio_channel_closed_ != nullptr) {
             on_audio_channel_closed_();
         }
     });
 
-    if (!websocket_->Connect(url.c_str())) {
-        ESP_LOGE(TAG, "Failed to connect to websocket server");
-        SetError(Lang::Strings::SERVER_NOT_FOUND);
+    // Published only once connected, a close from another task never frees it mid-connect
+    if (!websocket->Connect(url.c_str())) {
+        delete websocket;
         return false;
     }
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    websocket_ = websocket;
+    return true;
+}
 
+bool WebsocketProtocol::ExchangeHello(bool warm) {
+    xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
+    server_rehello_ = false;
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    StopUdpAudio();
+    udp_offered_ = false;
+#endif
     // Send hello message to describe the client
     // keys: message type, version, audio_params (format, sample_rate, channels)
     std::string message = "{";
     message += "\"type\":\"hello\",";
     message += "\"version\": 1,";
     message += "\"transport\":\"websocket\",";
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    message += "\"udp_audio\":true,";
+#endif
     message += "\"audio_params\":{";
-    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(OPUS_FRAME_DURATION_MS);
+    message += "\"format\":\"opus\", \"sample_rate\":16000, \"channels\":1, \"frame_duration\":" + std::to_string(uplink_frame_duration_);
+    message += AudioBatchHelloParams();
     message += "}}";
     if (!SendText(message)) {
         return false;
     }
 
     // Wait for server hello
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
-    if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
+    int timeout_ms = warm ? WEBSOCKET_WARM_HELLO_TIMEOUT_MS : WEBSOCKET_HELLO_TIMEOUT_MS;
+    if (!WaitForServerHello(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, timeout_ms)) {
+        if (warm) {
+            ESP_LOGW(TAG, "No server hello on the warm socket");
+            return false;
+        }
         ESP_LOGE(TAG, "Failed to receive server hello");
         SetError(Lang::Strings::SERVER_TIMEOUT);
         return false;
     }
 
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    if (udp_offered_) {
+        StartUdpAudio();
     }
-
+#endif
     return true;
 }
 
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+// Audio starts in the websocket, probes go out over UDP and the first packet from the server
+// moves the uplink there. The server moves its downlink once our first UDP packet arrives.
+void WebsocketProtocol::StartUdpAudio() {
+    {
+        std::lock_guard<std::mutex> lock(sequence_mutex_);
+        udp_sequence_synced_ = false;
+    }
+    if (!udp_channel_.Open(udp_server_, udp_port_, udp_key_, udp_nonce_,
+        [this](std::vector<uint8_t>&& data, uint32_t sequence) {
+            OnUdpPacket(std::move(data), sequence);
+        })) {
+        ReportAudioPath();
+        return;
+    }
+    udp_probe_start_ = esp_timer_get_time();
+    udp_channel_.Send(std::vector<uint8_t>());
+    esp_timer_stop(udp_probe_timer_);
+    esp_timer_start_periodic(udp_probe_timer_, WEBSOCKET_UDP_PROBE_INTERVAL_MS * 1000);
+}
+
+void WebsocketProtocol::StopUdpAudio() {
+    esp_timer_stop(udp_probe_timer_);
+    udp_active_ = false;
+    udp_channel_.Close();
+}
+
+void WebsocketProtocol::OnUdpPacket(std::vector<uint8_t>&& data, uint32_t sequence) {
+    last_incoming_time_ = std::chrono::steady_clock::now();
+    if (!udp_active_.exchange(true)) {
+        ESP_LOGI(TAG, "UDP answered after %lld ms, audio moves to UDP", (esp_timer_get_time() - udp_probe_start_) / 1000);
+        // The websocket write must not hold up the UDP receive task
+        Application::GetInstance().Schedule([this]() {
+            ReportAudioPath();
+        });
+    }
+    // Probes carry no audio
+    if (data.empty() || warm_) {
+        return;
+    }
+    uint32_t mapped;
+    {
+        std::lock_guard<std::mutex> lock(sequence_mutex_);
+        if (!udp_sequence_synced_) {
+            udp_sequence_offset_ = (int32_t)(remote_sequence_ + 1 - sequence);
+            udp_sequence_synced_ = true;
+        }
+        mapped = sequence + udp_sequence_offset_;
+        if ((int32_t)(mapped - remote_sequence_) > 0) {
+            remote_sequence_ = mapped;
+        }
+    }
+    if (on_incoming_audio_ != nullptr) {
+        on_incoming_audio_(std::move(data), mapped);
+    }
+}
+
+void WebsocketProtocol::ReportAudioPath() {
+    ESP_LOGI(TAG, "Audio path: %s", audio_path());
+    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"audio_path\",\"path\":\"";
+    message += audio_path();
+    message += "\"}";
+    SendControl(message);
+}
+#endif
+
 void WebsocketProtocol::ParseServerHello(const cJSON* root) {
     auto transport = cJSON_GetObjectItem(root, "transport");
     if (transport == nullptr || strcmp(transport->valuestring, "websocket") != 0) {
@@ -156,6 +434,24 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
             server_frame_duration_ = frame_duration->valueint;
         }
     }
+    ParseAudioBatch(audio_params);
+    server_rehello_ = cJSON_IsTrue(cJSON_GetObjectItem(root, "rehello"));
+
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    // Servers without UDP support leave it out, audio then stays in the websocket
+    auto udp = cJSON_GetObjectItem(root, "udp");
+    auto server = cJSON_GetObjectItem(udp, "server");
+    auto port = cJSON_GetObjectItem(udp, "port");
+    auto key = cJSON_GetObjectItem(udp, "key");
+    auto nonce = cJSON_GetObjectItem(udp, "nonce");
+    if (cJSON_IsString(server) && cJSON_IsNumber(port) && cJSON_IsString(key) && cJSON_IsString(nonce)) {
+        udp_server_ = server->valuestring;
+        udp_port_ = port->valueint;
+        udp_key_ = key->valuestring;
+        udp_nonce_ = nonce->valuestring;
+        udp_offered_ = true;
+    }
+#endif
 
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
 }
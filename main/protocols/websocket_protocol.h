@@ -7,26 +7,84 @@
 #include <web_socket.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <esp_timer.h>
+#include <mutex>
+
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+#include "udp_audio_channel.h"
+#endif
 
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
 
+// Audio stays in the websocket until a probe over UDP is answered within this time
+#define WEBSOCKET_UDP_PROBE_INTERVAL_MS 200
+#define WEBSOCKET_UDP_PROBE_TIMEOUT_MS 1500
+#define WEBSOCKET_HELLO_TIMEOUT_MS 10000
+// A server that took the goodbye answers the next hello at once, a silent one never will
+#define WEBSOCKET_WARM_HELLO_TIMEOUT_MS 2000
+
 class WebsocketProtocol : public Protocol {
 public:
     WebsocketProtocol();
     ~WebsocketProtocol();
 
     void Start() override;
-    void SendAudio(const std::vector<uint8_t>& data) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
+    void Preconnect() override;
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    const char* audio_path() const override { return udp_active_ ? "udp" : "websocket"; }
+#endif
 
 private:
     EventGroupHandle_t event_group_handle_;
+    // Audio is sent from the uplink task and the open task replaces or frees the socket while the
+    // main loop and timers query it, every access to websocket_ goes through channel_mutex_
+    mutable std::mutex channel_mutex_;
     WebSocket* websocket_ = nullptr;
+    // Websocket frames are never lost or reordered, number them for the jitter buffer.
+    // The websocket and UDP receive tasks both advance it, sequence_mutex_ guards the numbering.
+    std::mutex sequence_mutex_;
+    uint32_t remote_sequence_ = 0;
+    // The server hello advertised "rehello": another hello on this socket starts a new session
+    std::atomic<bool> server_rehello_{false};
+
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    // Audio side channel offered in the server hello, control messages stay in the websocket
+    UdpAudioChannel udp_channel_;
+    std::atomic<bool> udp_active_{false};
+    bool udp_offered_ = false;
+    std::string udp_server_;
+    int udp_port_ = 0;
+    std::string udp_key_;
+    std::string udp_nonce_;
+    std::atomic<int64_t> udp_probe_start_{0};
+    esp_timer_handle_t udp_probe_timer_ = nullptr;
+    // Maps UDP sequence numbers onto the websocket numbering, the jitter buffer sees one stream.
+    // Guarded by sequence_mutex_.
+    int32_t udp_sequence_offset_ = 0;
+    bool udp_sequence_synced_ = false;
+
+    void StartUdpAudio();
+    void StopUdpAudio();
+    void OnUdpPacket(std::vector<uint8_t>&& data, uint32_t sequence);
+    void ReportAudioPath();
+#endif
 
+    bool HasSocket() const;
+    bool IsSocketConnected() const;
+    void ResetRemoteSequence();
+    bool ConnectWebsocket(const std::string& url);
+    // A warm hello waits briefly and leaves the error to the reconnect that follows
+    bool ExchangeHello(bool warm);
     void ParseServerHello(const cJSON* root);
     bool SendText(const std::string& text) override;
+    void WriteAudio(const std::vector<uint8_t>& data) override;
+    // Masked frame header, TLS record, TCP and IP headers. Over UDP: nonce, UDP and IP headers.
+    int audio_write_overhead() const override;
+    void SendKeepAlive() override;
+    void CloseTransport() override;
 };
 
 #endif
@@ -8,6 +8,8 @@
 #include <esp_partition.h>
 #include <esp_app_desc.h>
 #include <esp_ota_ops.h>
+#include <esp_attr.h>
+#include <atomic>
 
 
 #define TAG "SystemInfo"
@@ -126,3 +128,58 @@ exit:    //Common return path
     return ret;
 }
 
+
+bool SystemInfo::GetIdleRunTime(int core, uint32_t& idle, uint32_t& total) {
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    idle = ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+    total = portGET_RUN_TIME_COUNTER_VALUE();
+    return true;
+#else
+    return false;
+#endif
+}
+
+#define MAX_TRACKED_TASKS 4
+static TaskHandle_t s_tracked_tasks[MAX_TRACKED_TASKS];
+static std::atomic<int32_t> s_tracked_allocations[MAX_TRACKED_TASKS];
+
+#if CONFIG_HEAP_ALLOCATION_STATS
+// Called by the heap component for every allocation
+extern "C" IRAM_ATTR void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+    TaskHandle_t current = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < MAX_TRACKED_TASKS; i++) {
+        if (s_tracked_tasks[i] == current && current != nullptr) {
+            s_tracked_allocations[i].fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+extern "C" IRAM_ATTR void esp_heap_trace_free_hook(void* ptr) {
+}
+#endif
+
+void SystemInfo::TrackHeapAllocations(TaskHandle_t task) {
+    for (int i = 0; i < MAX_TRACKED_TASKS; i++) {
+        if (s_tracked_tasks[i] == task) {
+            return;
+        }
+        if (s_tracked_tasks[i] == nullptr) {
+            s_tracked_allocations[i] = 0;
+            s_tracked_tasks[i] = task;
+            return;
+        }
+    }
+    ESP_LOGW(TAG, "Too many tracked tasks");
+}
+
+int32_t SystemInfo::GetHeapAllocations(TaskHandle_t task) {
+#if CONFIG_HEAP_ALLOCATION_STATS
+    for (int i = 0; i < MAX_TRACKED_TASKS; i++) {
+        if (s_tracked_tasks[i] == task) {
+            return s_tracked_allocations[i].load(std::memory_order_relaxed);
+        }
+    }
+#endif
+    return -1;
+}
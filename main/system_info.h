@@ -5,6 +5,7 @@
 
 #include <esp_err.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 class SystemInfo {
 public:
@@ -14,6 +15,12 @@ public:
     static std::string GetMacAddress();
     static std::string GetChipModelName();
     static esp_err_t PrintRealTimeStats(TickType_t xTicksToWait);
+
+    // Count heap allocations made by a task, needs CONFIG_HEAP_ALLOCATION_STATS (returns -1 without it)
+    static void TrackHeapAllocations(TaskHandle_t task);
+    static int32_t GetHeapAllocations(TaskHandle_t task);
+    // Run time counters of the idle task on a core and of the whole system, same units as PrintRealTimeStats
+    static bool GetIdleRunTime(int core, uint32_t& idle, uint32_t& total);
 };
 
 #endif // _SYSTEM_INFO_H_
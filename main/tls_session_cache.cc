@@ -0,0 +1,157 @@
+#include "tls_session_cache.h"
+#include "settings.h"
+
+#include <esp_log.h>
+#include <cstdio>
+
+#define TAG "TlsSessionCache"
+
+// NVS strings are limited to 4000 bytes, sessions are stored hex encoded
+#define TLS_SESSION_MAX_PERSIST_SIZE 1900
+
+std::string TlsSessionCache::MakeKey(const std::string& host, int port) {
+    return host + ":" + std::to_string(port);
+}
+
+std::string TlsSessionCache::MakeNvsKey(const std::string& key) {
+    // NVS keys are at most 15 characters, use a FNV-1a hash of host:port
+    uint32_t hash = 2166136261u;
+    for (char c : key) {
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    char nvs_key[16];
+    snprintf(nvs_key, sizeof(nvs_key), "s%08lx", (unsigned long)hash);
+    return nvs_key;
+}
+
+#if CONFIG_TLS_SESSION_PERSIST
+static int HexNibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// False on an odd length or any character that is not hex, the NVS copy is then corrupt
+static bool DecodeHex(const std::string& hex, std::vector<uint8_t>& data) {
+    if (hex.size() % 2 != 0) {
+        return false;
+    }
+    data.resize(hex.size() / 2);
+    for (size_t i = 0; i < data.size(); i++) {
+        int high = HexNibble(hex[i * 2]);
+        int low = HexNibble(hex[i * 2 + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        data[i] = (uint8_t)((high << 4) | low);
+    }
+    return true;
+}
+#endif
+
+bool TlsSessionCache::Restore(const std::string& host, int port, mbedtls_ssl_context* ssl) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto key = MakeKey(host, port);
+    auto it = sessions_.find(key);
+#if CONFIG_TLS_SESSION_PERSIST
+    if (it == sessions_.end()) {
+        Settings settings("tls", false);
+        auto hex = settings.GetString(MakeNvsKey(key));
+        std::vector<uint8_t> data;
+        if (!hex.empty()) {
+            if (DecodeHex(hex, data)) {
+                it = sessions_.emplace(key, std::move(data)).first;
+            } else {
+                ESP_LOGW(TAG, "Stored session for %s is corrupt, dropping it", key.c_str());
+                Settings writable("tls", true);
+                writable.EraseKey(MakeNvsKey(key));
+            }
+        }
+    }
+#endif
+    if (it == sessions_.end()) {
+        return false;
+    }
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    int ret = mbedtls_ssl_session_load(&session, it->second.data(), it->second.size());
+    if (ret == 0) {
+        ret = mbedtls_ssl_set_session(ssl, &session);
+    }
+    mbedtls_ssl_session_free(&session);
+    if (ret != 0) {
+        ESP_LOGW(TAG, "Cached session for %s is unusable: -0x%x", key.c_str(), -ret);
+        sessions_.erase(it);
+#if CONFIG_TLS_SESSION_PERSIST
+        // Otherwise the next connection loads it from NVS again
+        Settings settings("tls", true);
+        settings.EraseKey(MakeNvsKey(key));
+#endif
+        return false;
+    }
+    return true;
+}
+
+void TlsSessionCache::Save(const std::string& host, int port, const mbedtls_ssl_context* ssl, bool resumed) {
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    if (mbedtls_ssl_get_session(ssl, &session) != 0) {
+        mbedtls_ssl_session_free(&session);
+        return;
+    }
+    size_t length = 0;
+    mbedtls_ssl_session_save(&session, nullptr, 0, &length);
+    std::vector<uint8_t> data(length);
+    int ret = mbedtls_ssl_session_save(&session, data.data(), data.size(), &length);
+    mbedtls_ssl_session_free(&session);
+    if (ret != 0 || length == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto key = MakeKey(host, port);
+    sessions_[key] = data;
+#if CONFIG_TLS_SESSION_PERSIST
+    // Resumed sessions only refresh the RAM copy, the flash is written after full handshakes
+    if (!resumed && length <= TLS_SESSION_MAX_PERSIST_SIZE) {
+        static const char hex_chars[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(length * 2);
+        for (auto byte : data) {
+            hex.push_back(hex_chars[byte >> 4]);
+            hex.push_back(hex_chars[byte & 0x0f]);
+        }
+        Settings settings("tls", true);
+        settings.SetString(MakeNvsKey(key), hex);
+    }
+#endif
+}
+
+void TlsSessionCache::Forget(const std::string& host, int port) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto key = MakeKey(host, port);
+    sessions_.erase(key);
+#if CONFIG_TLS_SESSION_PERSIST
+    Settings settings("tls", true);
+    settings.EraseKey(MakeNvsKey(key));
+#endif
+}
+
+void TlsSessionCache::RecordHandshake(const char* transport, int64_t duration_us, bool resumed) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& stats = stats_[transport];
+    uint32_t duration_ms = duration_us / 1000;
+    if (resumed) {
+        stats.resumed_count++;
+        stats.resumed_total_ms += duration_ms;
+    } else {
+        stats.full_count++;
+        stats.full_total_ms += duration_ms;
+    }
+    ESP_LOGI(TAG, "%s handshake %lu ms (%s), full avg %lu ms x%lu, resumed avg %lu ms x%lu",
+        transport, duration_ms, resumed ? "resumed" : "full",
+        stats.full_count > 0 ? stats.full_total_ms / stats.full_count : 0, stats.full_count,
+        stats.resumed_count > 0 ? stats.resumed_total_ms / stats.resumed_count : 0, stats.resumed_count);
+}
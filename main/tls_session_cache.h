@@ -0,0 +1,52 @@
+#ifndef _TLS_SESSION_CACHE_H_
+#define _TLS_SESSION_CACHE_H_
+
+#include <mbedtls/ssl.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstdint>
+
+// TLS sessions (ticket or session ID) per host:port, so the next connection to the same
+// server can resume instead of running a full handshake. Kept in RAM, and in NVS when
+// CONFIG_TLS_SESSION_PERSIST is set so the first connection after a reboot resumes too.
+// Also keeps handshake timing per transport.
+class TlsSessionCache {
+public:
+    static TlsSessionCache& GetInstance() {
+        static TlsSessionCache instance;
+        return instance;
+    }
+    TlsSessionCache(const TlsSessionCache&) = delete;
+    TlsSessionCache& operator=(const TlsSessionCache&) = delete;
+
+    // Offers the cached session to the handshake, returns false if there is none
+    bool Restore(const std::string& host, int port, mbedtls_ssl_context* ssl);
+    // Saves the session of a finished handshake
+    void Save(const std::string& host, int port, const mbedtls_ssl_context* ssl, bool resumed);
+    // Drops the session after the server refused it or the connection failed
+    void Forget(const std::string& host, int port);
+
+    void RecordHandshake(const char* transport, int64_t duration_us, bool resumed);
+
+private:
+    TlsSessionCache() = default;
+
+    struct HandshakeStats {
+        uint32_t full_count = 0;
+        uint32_t full_total_ms = 0;
+        uint32_t resumed_count = 0;
+        uint32_t resumed_total_ms = 0;
+    };
+
+    std::mutex mutex_;
+    std::map<std::string, std::vector<uint8_t>> sessions_;
+    std::map<std::string, HandshakeStats> stats_;
+
+    static std::string MakeKey(const std::string& host, int port);
+    static std::string MakeNvsKey(const std::string& key);
+};
+
+#endif // _TLS_SESSION_CACHE_H_